@@ -0,0 +1,137 @@
+/**
+ * @file compact.h
+ * @brief Images with reduced precision storage
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "image.h"
+#include <vector>
+#include <cstring>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+/// Half precision float (IEEE 754 binary16), used only for storage.
+///
+/// Conversions use the F16C instructions when the compiler targets them (for
+/// example with -mf16c or -march=native), portable code otherwise. Rounding is
+/// to nearest even in both cases.
+class Half {
+    unsigned short bits;
+public:
+    Half(): bits(0) {}
+    Half(float v): bits(from_float(v)) {}
+    operator float() const { return to_float(bits); }
+
+    static unsigned short from_float(float v);
+    static float to_float(unsigned short h);
+#ifndef __F16C__
+private:
+    static float convert(unsigned short h);
+    static const float* make_table();
+    static const float* const table; ///< to_float of all 65536 values
+#endif
+};
+
+#ifdef __F16C__
+inline unsigned short Half::from_float(float v) {
+    return static_cast<unsigned short>(_cvtss_sh(v, 0));
+}
+inline float Half::to_float(unsigned short h) {
+    return _cvtsh_ss(h);
+}
+#else
+/// Conversion float->half, overflow gives infinity
+inline unsigned short Half::from_float(float v) {
+    unsigned int f;
+    std::memcpy(&f, &v, sizeof(f));
+    unsigned int sign = (f>>16) & 0x8000;
+    f &= 0x7fffffff;
+    if(f >= 0x7f800000) // Inf or NaN
+        return static_cast<unsigned short>(sign|0x7c00|
+                                           (f>0x7f800000? 0x200: 0));
+    if(f >= 0x477ff000) // Overflow after rounding
+        return static_cast<unsigned short>(sign|0x7c00);
+    if(f < 0x38800000) { // Subnormal half, or zero
+        if(f < 0x33000000)
+            return static_cast<unsigned short>(sign);
+        unsigned int m = (f&0x7fffff)|0x800000, shift = 126-(f>>23);
+        unsigned int h = m>>shift, rem = m&((1u<<shift)-1), half=1u<<(shift-1);
+        h += (rem+(h&1) > half); // Round to nearest even, no branch
+        return static_cast<unsigned short>(sign|h);
+    }
+    unsigned int h = ((f>>13)-(112<<10)), rem = f&0x1fff;
+    h += (rem+(h&1) > 0x1000);
+    return static_cast<unsigned short>(sign|h);
+}
+
+/// Conversion half->float, exact, by look-up in table
+inline float Half::to_float(unsigned short h) {
+    return table[h];
+}
+
+/// Conversion half->float, exact, used to fill the table of to_float
+inline float Half::convert(unsigned short h) {
+    unsigned int sign = (h&0x8000)<<16, e = (h>>10)&0x1f, m = h&0x3ff, f;
+    if(e == 0x1f) // Inf or NaN
+        f = sign|0x7f800000|(m<<13);
+    else if(e != 0) // Normal
+        f = sign|((e+112)<<23)|(m<<13);
+    else if(m == 0) // Zero
+        f = sign;
+    else { // Subnormal
+        e = 113;
+        while(! (m&0x400)) { m <<= 1; --e; }
+        f = sign|(e<<23)|((m&0x3ff)<<13);
+    }
+    float v;
+    std::memcpy(&v, &f, sizeof(v));
+    return v;
+}
+#endif
+
+/// Image whose pixels are stored with type T, converted to float when read.
+///
+/// Contrary to Image, the copy is deep. Instantiated for unsigned short (fixed
+/// point values) and Half.
+template <class T>
+class CompactImage {
+    TrackedVector<T> tab;
+    int w, h;
+public:
+    CompactImage(): w(0), h(0) {}
+    CompactImage(int width, int height)
+    : tab(static_cast<size_t>(width)*height), w(width), h(height) {}
+    /// Bytes counted for an image of size \a width x \a height.
+    static long long memory(int width, int height) {
+        return TrackedVector<T>::memory(static_cast<long long>(width)*height);
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+    T  operator()(int i,int j) const { return tab[j*w+i]; }
+    T& operator()(int i,int j)       { return tab[j*w+i]; }
+
+    // Implemented in filters.cpp
+    Image boxFilter(int radius, float scale=1.0f) const;
+    static void boxFilter(const CompactImage* const* in, int n, int radius,
+                          Image* out, TrackedVector<float>& S,
+                          float scale=1.0f);
+    static size_t boxFilterBuffer(int n, int width, int height);
+};
+
+#endif
@@ -17,41 +17,204 @@
  */
 
 #include "costVolume.h"
+#include "guidance.h"
 #include "image.h"
-#include "io_png.h"
+#include "compact.h"
+#include "fixedPoint.h"
+#include "profile.h"
+#include "progress.h"
 #include <algorithm>
+#include <vector>
 #include <limits>
-#include <iostream>
-
-/// Inverse of symmetric 3x3 matrix
-static void inverseSym3(const float* matrix, float* inverse) {
-    inverse[0] = matrix[4]*matrix[8] - matrix[5]*matrix[7];
-    inverse[1] = matrix[2]*matrix[7] - matrix[1]*matrix[8];
-    inverse[2] = matrix[1]*matrix[5] - matrix[2]*matrix[4];
-    float det = matrix[0]*inverse[0]+matrix[3]*inverse[1]+matrix[6]*inverse[2];
-    det = 1/det;
-    inverse[0] *= det;
-    inverse[1] *= det;
-    inverse[2] *= det;
-    inverse[3] = inverse[1];
-    inverse[4] = (matrix[0]*matrix[8] - matrix[2]*matrix[6]) * det;
-    inverse[5] = (matrix[2]*matrix[3] - matrix[0]*matrix[5]) * det;
-    inverse[6] = inverse[2];
-    inverse[7] = inverse[5];
-    inverse[8] = (matrix[0]*matrix[4] - matrix[1]*matrix[3]) * det;
-}
-
-/// Covariance of patches of radius \a r between images, eq. (14).
-static Image covariance(Image im1, Image mean1, Image im2, Image mean2, int r) {
-    return (im1*im2).boxFilter(r) - mean1*mean2;
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/// Costs stored on 16 bits (param.compact_storage): value v is stored as
+/// v*scale rounded, scale mapping the max cost to 65535.
+struct QuantizedCost {
+    CompactImage<unsigned short> im;
+    float scale;
+    QuantizedCost(int w, int h, float maxCost)
+    : im(w,h), scale(maxCost>0? 65535/maxCost: 1.0f) {}
+};
+
+/// Store value \a v of pixel (x,y) in \a cost.
+static inline void store(Image& cost, int x, int y, float v) {
+    cost(x,y) = v;
+}
+static inline void store(QuantizedCost& cost, int x, int y, float v) {
+    v = std::min(std::max(v*cost.scale+0.5f, 0.0f), 65535.0f);
+    cost.im(x,y) = static_cast<unsigned short>(v);
+}
+
+/// Whether costs and moments are computed in fixed point (option --fixed,
+/// without subsampling).
+static bool fixed_point(const ParamGuidedFilter& param) {
+    return param.fixed_point && param.subsample<=1;
+}
+
+/// Whether costs are stored on 16 bits, see QuantizedCost (option --compact,
+/// without subsampling nor fixed point).
+static bool quantized(const ParamGuidedFilter& param) {
+    return param.compact_storage && param.subsample<=1 && !fixed_point(param);
+}
+
+/// Buffers of a Workspace for a tile of \a width x \a height, with guide of
+/// \a channels, depending on the options in \a param.
+///
+/// It is shared by the constructor of Workspace and filter_cost_volume_memory,
+/// so that the prediction of memory follows the allocations. Sizes depend
+/// only on the tile and the options: the box filters use running sums or
+/// integral images, whatever the radius.
+struct WorkspaceLayout {
+    int width, height; ///< Tile
+    int w, h; ///< Subsampled tile, size of all images except \a up
+    int n; ///< Number of moments, coefficients and their means (channels+1)
+    bool costSub, up; ///< Subsampled cost and upsampled means (s>1)
+    int prod, halfProd; ///< Numbers of float and half float products
+    bool coef, half; ///< Float or half float coefficients
+    size_t integral, sums; ///< Sizes of box filter buffers (double, float)
+    WorkspaceLayout(int width, int height, int channels,
+                    const ParamGuidedFilter& param);
+    long long memory() const;
+};
+
+/// Layout of workspace for tile \a width x \a height.
+WorkspaceLayout::WorkspaceLayout(int width0, int height0, int channels,
+                                 const ParamGuidedFilter& param)
+: width(width0), height(height0) {
+    const int s = std::max(1, param.subsample);
+    w=(width+s-1)/s; h=(height+s-1)/s;
+    n = channels+1;
+    costSub = up = (s > 1);
+    const bool fixed=fixed_point(param), quantize=quantized(param);
+    prod = (fixed||quantize)? 0: channels;
+    halfProd = quantize? channels: 0;
+    half = param.compact_storage;
+    coef = ! half;
+    // Double sums for the box filters of float costs or coefficients
+    integral = (prod>0 || coef)? static_cast<size_t>(n)*w*h: 0;
+    sums = half? CompactImage<Half>::boxFilterBuffer(n, w, h): 0;
+}
+
+/// Bytes of the buffers of the workspace. The coefficients share the images
+/// of products.
+long long WorkspaceLayout::memory() const {
+    const long long sub=Image::memory(w,h);
+    const long long sub16=CompactImage<Half>::memory(w,h);
+    long long m = 2*n*sub + prod*sub + halfProd*sub16; // With moments, means
+    if(costSub)
+        m += sub;
+    if(coef)
+        m += (n-prod)*sub;
+    if(half)
+        m += n*sub16;
+    if(up)
+        m += n*Image::memory(width,height);
+    return m + TrackedVector<double>::memory(static_cast<long long>(integral))
+             + TrackedVector<float>::memory(static_cast<long long>(sums));
+}
+
+/// Images of the loop on disparities of filter_tile, allocated before it so
+/// that the loop makes no heap allocation.
+///
+/// The coefficients of the linear model are stored in \a coef if they are
+/// floats, in \a half if they are half floats (compact storage). The
+/// products of guide and quantized costs are half floats too, in \a halfProd.
+struct Workspace {
+    Image costSub; ///< Subsampled cost (fast guided filter)
+    Image prod[3]; ///< Products of guide channels and cost
+    CompactImage<Half> halfProd[3];
+    Image moments[4]; ///< Mean of cost and its covariances with guide
+    Image coef[4]; ///< Offset and coefficients a of linear model
+    CompactImage<Half> half[4];
+    Image mean[4]; ///< Means of coefficients in patches
+    Image up[4]; ///< Upsampled means (fast guided filter)
+    TrackedVector<double> integral; ///< Buffer of box filters
+    TrackedVector<float> sums; ///< Buffer of box filters of compact images
+    std::vector<int> x0; ///< Buffers of upsample
+    std::vector<float> fx;
+    explicit Workspace(const WorkspaceLayout& layout);
+};
+
+/// Allocate the images of \a layout.
+Workspace::Workspace(const WorkspaceLayout& l)
+: integral(l.integral), sums(l.sums) {
+    if(l.costSub)
+        costSub = Image(l.w,l.h);
+    for(int i=0; i<l.prod; i++)
+        prod[i] = Image(l.w,l.h);
+    for(int i=0; i<l.halfProd; i++)
+        halfProd[i] = CompactImage<Half>(l.w,l.h);
+    for(int i=0; i<l.n; i++) {
+        moments[i] = Image(l.w,l.h);
+        if(l.half)
+            half[i] = CompactImage<Half>(l.w,l.h);
+        if(l.coef) // Products are not used any more by then
+            coef[i] = (i<l.prod)? prod[i]: Image(l.w,l.h);
+        mean[i] = Image(l.w,l.h);
+        if(l.up)
+            up[i] = Image(l.width,l.height);
+    }
+}
+
+/// Pixelwise product of \a guide and cost \a p, written in \a prod.
+static void product(Image guide, Image p, Image& prod) {
+    const int w=guide.width(), h=guide.height();
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            prod(x,y) = guide(x,y)*p(x,y);
+}
+static void product(Image guide, const QuantizedCost& p,
+                    CompactImage<Half>& prod) {
+    const int w=guide.width(), h=guide.height();
+    const float unit = 1/p.scale;
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            prod(x,y) = guide(x,y)*(p.im(x,y)*unit);
+}
+
+/// Images of products of the guide with cost \a p in \a ws.
+static Image* products(const Image&, Workspace& ws) {
+    return ws.prod;
+}
+static CompactImage<Half>* products(const QuantizedCost&, Workspace& ws) {
+    return ws.halfProd;
+}
+
+/// Means in patches of radius \a r of cost \a p and of the \a n images
+/// ws.prod, written in ws.moments, accumulated in double in a single batch.
+/// A quantized cost and its products ws.halfProd are accumulated in float.
+static void box(Image p, int n, int r, Workspace& ws) {
+    const Image* in[4] = {&p};
+    for(int i=0; i<n; i++)
+        in[i+1] = &ws.prod[i];
+    Image::boxFilter(in, n+1, r, ws.moments, ws.integral);
+}
+static void box(const QuantizedCost& p, int n, int r, Workspace& ws) {
+    const CompactImage<unsigned short>* cost = &p.im;
+    CompactImage<unsigned short>::boxFilter(&cost, 1, r, ws.moments,
+                                            ws.sums, 1/p.scale);
+    const CompactImage<Half>* in[3];
+    for(int i=0; i<n; i++)
+        in[i] = &ws.halfProd[i];
+    CompactImage<Half>::boxFilter(in, n, r, ws.moments+1, ws.sums);
 }
 
 /// Compute color cost according to eq. (3).
 ///
 /// Upper-bounded (by \a maxCost) average of color absolute differences at
 /// pixels im1(x,y) and im2(x+d,y).
-inline float cost_color(Image im1R, Image im1G, Image im1B,
-                        Image im2R, Image im2G, Image im2B,
+inline float cost_color(const Image& im1R, const Image& im1G,
+                        const Image& im1B, const Image& im2R,
+                        const Image& im2G, const Image& im2B,
                         int x, int y, int d, float maxCost) {
     float col1[3] = {im1R(x,y), im1G(x,y), im1B(x,y)};
     float col2[3] = {im2R(x+d,y), im2G(x+d,y), im2B(x+d,y)};
@@ -71,7 +234,7 @@ inline float cost_color(Image im1R, Image im1G, Image im1B,
 ///
 /// Upper-bounded (by \a maxCost) x-derivative difference at
 /// pixels im1(x,y) and im2(x+d,y).
-inline float cost_gradient(Image gradient1, Image gradient2,
+inline float cost_gradient(const Image& gradient1, const Image& gradient2,
                            int x, int y, int d, float maxCost) {
     float cost = gradient1(x,y)-gradient2(x+d,y); // Eq. (5)
     if(cost < 0)
@@ -81,108 +244,883 @@ inline float cost_gradient(Image gradient1, Image gradient2,
     return cost;
 }
 
+/// Terms of the matching cost, eq. (7), that are evaluated.
+enum CostTerms {
+    COLOR_ONLY,    ///< alpha=0
+    GRADIENT_ONLY, ///< alpha=1
+    BLENDED        ///< 0<alpha<1
+};
+
+/// Compute image of matching costs at disparity \a d, evaluating only the
+/// terms of the cost with non-zero weight.
+///
+/// The result is the same as the blend of both terms, eq. (7), also for
+/// pixels matched outside im2, which get the max cost.
+template <CostTerms terms, class Cost>
+static void compute_cost_terms(const Image& im1R, const Image& im1G,
+                               const Image& im1B, const Image& im2R,
+                               const Image& im2G, const Image& im2B,
+                               const Image& gradient1, const Image& gradient2,
+                               int d, int x1, int x2, int fullWidth,
+                               const ParamGuidedFilter& param,
+                               Cost& cost) {
+    const int width=im1R.width(), height=im1R.height();
+    const int dTile = d+x1-x2; // Disparity between tiles
+    const float alpha=param.alpha;
+    const float maxColor=param.color_threshold;
+    const float maxGrad=param.gradient_threshold;
+    const float maxCost = (1-alpha)*maxColor + alpha*maxGrad;
+    // Columns matched inside im2
+    const int xMin = std::min(width, std::max(0, -x1-d));
+    const int xMax = std::max(xMin, std::min(width, fullWidth-x1-d));
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(width,height))
+#endif
+    for(int y=0; y<height; y++) {
+        for(int x=0; x<xMin; x++)
+            store(cost, x, y, maxCost);
+        for(int x=xMin; x<xMax; x++) {
+            float c; // Combination of the two penalties, eq. (7)
+            if(terms == COLOR_ONLY)
+                c = cost_color(im1R, im1G, im1B, im2R, im2G, im2B,
+                               x, y, dTile, maxColor);
+            else if(terms == GRADIENT_ONLY)
+                c = cost_gradient(gradient1, gradient2, x, y, dTile, maxGrad);
+            else
+                c = (1-alpha)*cost_color(im1R, im1G, im1B, im2R, im2G, im2B,
+                                         x, y, dTile, maxColor) +
+                    alpha*cost_gradient(gradient1, gradient2,
+                                        x, y, dTile, maxGrad);
+            store(cost, x, y, c);
+        }
+        for(int x=xMax; x<width; x++)
+            store(cost, x, y, maxCost);
+    }
+}
+
 /// Compute image of matching costs at disparity \a d.
 ///
 /// At each pixel, a linear combination of colors L1 distance (with max
 /// threshold) and x-derivatives absolute difference (with max threshold).
-static void compute_cost(Image im1R, Image im1G, Image im1B,
-                         Image im2R, Image im2G, Image im2B,
-                         Image gradient1, Image gradient2,
-                         int d, const ParamGuidedFilter& param,
-                         Image& cost) {
-    const int width=im1R.width(), height=im1R.height();
+/// The images can be tiles of full images of width \a fullWidth, whose first
+/// columns are at abscissa \a x1 (for im1) and \a x2 (for im2) in full images.
+/// The cost is stored in an Image or a QuantizedCost.
+template <class Cost>
+static void compute_cost(const Image& im1R, const Image& im1G,
+                         const Image& im1B, const Image& im2R,
+                         const Image& im2G, const Image& im2B,
+                         const Image& gradient1, const Image& gradient2,
+                         int d, int x1, int x2, int fullWidth,
+                         const ParamGuidedFilter& param,
+                         Cost& cost) {
+    if(param.alpha == 0)
+        compute_cost_terms<COLOR_ONLY>(im1R,im1G,im1B, im2R,im2G,im2B,
+                                       gradient1, gradient2,
+                                       d, x1, x2, fullWidth, param, cost);
+    else if(param.alpha == 1)
+        compute_cost_terms<GRADIENT_ONLY>(im1R,im1G,im1B, im2R,im2G,im2B,
+                                          gradient1, gradient2,
+                                          d, x1, x2, fullWidth, param, cost);
+    else
+        compute_cost_terms<BLENDED>(im1R,im1G,im1B, im2R,im2G,im2B,
+                                    gradient1, gradient2,
+                                    d, x1, x2, fullWidth, param, cost);
+}
+
+/// Radius of the guided filter at resolution subsampled by param.subsample.
+static int subsampled_radius(const ParamGuidedFilter& param) {
+    const int s = param.subsample;
+    if(s <= 1)
+        return param.kernel_radius;
+    return std::max(1, (param.kernel_radius+s/2)/s);
+}
+
+/// Width of the band around a tile whose pixels contribute to its filtered
+/// costs: twice the radius, for the coefficients and for their averages.
+static int tile_margin(const ParamGuidedFilter& param) {
+    const int s = std::max(1, param.subsample);
+    return (s>1)? (2*subsampled_radius(param)+2)*s: 2*param.kernel_radius;
+}
+
+/// Coefficients a of the linear model, eq. (19), with
+/// (Sigma_k+\epsilon Id)^{-1} of eq. (21) precomputed in \a guide.
+template <class Coef>
+static void coefficients(const GuideStats& guide,
+                         Image covarRCost, Image covarGCost, Image covarBCost,
+                         Coef& aR, Coef& aG, Coef& aB) {
+    const int width=aR.width(), height=aR.height();
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(width,height))
+#endif
     for(int y=0; y<height; y++)
         for(int x=0; x<width; x++) {
-            float costColor = param.color_threshold; // Color L1 distance
-            float costGrad = param.gradient_threshold; // x-deriv abs diff
-            if(0<=x+d && x+d<width) {
-                costColor = cost_color(im1R, im1G, im1B, im2R, im2G, im2B,
-                                       x, y, d, param.color_threshold);
-                costGrad = cost_gradient(gradient1, gradient2,
-                                         x, y, d, param.gradient_threshold);
-            }
-            // Combination of the two penalties, eq. (7)
-            cost(x,y) = (1-param.alpha)*costColor + param.alpha*costGrad;
+            float rCost=covarRCost(x,y);
+            float gCost=covarGCost(x,y);
+            float bCost=covarBCost(x,y);
+            aR(x,y) = rCost * guide.invRR(x,y) +
+                      gCost * guide.invRG(x,y) +
+                      bCost * guide.invRB(x,y);
+            aG(x,y) = rCost * guide.invRG(x,y) +
+                      gCost * guide.invGG(x,y) +
+                      bCost * guide.invGB(x,y);
+            aB(x,y) = rCost * guide.invRB(x,y) +
+                      gCost * guide.invGB(x,y) +
+                      bCost * guide.invBB(x,y);
         }
 }
 
-/// Cost volume filtering
-Image filter_cost_volume(Image im1Color, Image im2Color,
-                         int dispMin, int dispMax,
-                         const ParamGuidedFilter& param) {
+/// Mean of cost \a p and its covariance with each channel of \a guideSub in
+/// patches of radius \a r, eq. (14), written in ws.moments.
+///
+/// The box filters of the cost and its products with the guide are batched.
+template <class Cost>
+static void moments(const Cost& p, Image guideSub, const GuideStats& guide,
+                    int r, Workspace& ws) {
+    const int n = guide.channels;
+    const Image mean[3] = {guide.meanR, guide.meanG, guide.meanB};
+    if(n == 1)
+        product(guideSub, p, products(p,ws)[0]);
+    else {
+        product(guideSub.r(), p, products(p,ws)[0]);
+        product(guideSub.g(), p, products(p,ws)[1]);
+        product(guideSub.b(), p, products(p,ws)[2]);
+    }
+    box(p, n, r, ws);
+    Image meanCost = ws.moments[0];
+    const int w=meanCost.width(), h=meanCost.height();
+    for(int i=0; i<n; i++) {
+        Image covar = ws.moments[i+1];
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+                covar(x,y) -= mean[i](x,y)*meanCost(x,y);
+    }
+}
+
+/// Labels of disparities in winner takes all selection: 0 if none yet, else
+/// d-dispMin+1.
+typedef TrackedVector<unsigned short> Labels;
+
+/// Lowest filtered cost at disparities not adjacent to the selected one,
+/// tracked during the winner takes all selection for the confidence map.
+///
+/// Disparities are visited in increasing order, so that when label L gets
+/// the lowest cost, the second lowest is the min over labels <= L-2.
+struct SecondBest {
+    Image second;   ///< Min of costs at labels at distance >=2 of selected one
+    Image before;   ///< Min of costs at labels <= L-2, L being the current one
+    Image previous; ///< Cost at label L-1
+    SecondBest(int w, int h);
+};
+
+/// All costs are initially infinite (max float).
+SecondBest::SecondBest(int w, int h)
+: second(w,h), before(w,h), previous(w,h) {
+    const float inf = std::numeric_limits<float>::max();
+    std::fill_n(&second(0,0), w*h, inf);
+    std::fill_n(&before(0,0), w*h, inf);
+    std::fill_n(&previous(0,0), w*h, inf);
+}
+
+/// Winner takes all label selection at pixel (x,y), eq. (8): keep \a label if
+/// filtered cost \a q is not higher than the current one. The second best
+/// cost is updated if \a second is not null.
+static inline void select_label(Image& cost, Labels& labels, int x, int y,
+                                float q, unsigned short label,
+                                SecondBest* second) {
+    unsigned short& l = labels[y*cost.width()+x];
+    if(second) {
+        if(cost(x,y) >= q)
+            second->second(x,y) = second->before(x,y);
+        else if(label >= l+2)
+            second->second(x,y) = std::min(second->second(x,y), q);
+        second->before(x,y) = std::min(second->before(x,y),
+                                       second->previous(x,y));
+        second->previous(x,y) = q;
+    }
+    if(cost(x,y) >= q) {
+        cost(x,y) = q;
+        l = label;
+    }
+}
+
+/// Means in patches of radius \a r of the \a n coefficients \a in of the
+/// linear model, written in ws.mean.
+static void box_coefficients(const Image* const* in, int n, int r,
+                             Workspace& ws) {
+    Image::boxFilter(in, n, r, ws.mean, ws.integral);
+}
+static void box_coefficients(const CompactImage<Half>* const* in, int n, int r,
+                             Workspace& ws) {
+    CompactImage<Half>::boxFilter(in, n, r, ws.mean, ws.sums);
+}
+
+/// Guided filtering of cost with color guide, from its moments, and winner
+/// takes all selection.
+///
+/// \a meanCost and \a covar are at the resolution of the statistics of the
+/// guide in \a guide, subsampled by factor \a s. \a guideColor is the guide at
+/// full resolution, where the filtered cost is computed. The coefficients of
+/// the linear model are stored in images of type Coef (Image or CompactImage).
+/// The filtered cost is not stored, but compared on the fly to \a cost to
+/// select \a label and to \a second, if not null.
+/// The coefficients are stored in \a coef, the other images are those of
+/// \a ws.
+template <class Coef>
+static void filter_color(Image meanCost, const Image covar[3],
+                         Image guideColor, const GuideStats& guide,
+                         int r, int s, Coef coef[4], Workspace& ws,
+                         Image& cost, Labels& labels, unsigned short label,
+                         SecondBest* second) {
+    const int w=meanCost.width(), h=meanCost.height();
+    const int width=guideColor.width(), height=guideColor.height();
+    ProfileTimer timer("linear_model");
+    Coef &offset=coef[0], &aR=coef[1], &aG=coef[2], &aB=coef[3];
+    coefficients(guide, covar[0], covar[1], covar[2], aR, aG, aB);
+
+    // Eq. (20) before averaging
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            offset(x,y) = meanCost(x,y) - aR(x,y)*guide.meanR(x,y)
+                - aG(x,y)*guide.meanG(x,y) - aB(x,y)*guide.meanB(x,y);
+    const Coef* in[4] = {&offset, &aR, &aG, &aB};
+    box_coefficients(in, 4, r, ws);
+    Image* out = ws.mean;
+    if(s > 1) {
+        for(int i=0; i<4; i++)
+            ws.mean[i].upsample(s, ws.up[i], ws.x0, ws.fx);
+        out = ws.up;
+    }
+    Image b=out[0], meanAR=out[1], meanAG=out[2], meanAB=out[3];
+    timer.stop();
+    ProfileTimer timerWTA("wta");
+    const Image R=guideColor.r(), G=guideColor.g(), B=guideColor.b();
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(width,height))
+#endif
+    for(int y=0; y<height; y++)
+        for(int x=0; x<width; x++) {
+            const float q = b(x,y) + (meanAR(x,y)*R(x,y) +
+                                      meanAG(x,y)*G(x,y) +
+                                      meanAB(x,y)*B(x,y)); // Eq. (22)
+            select_label(cost, labels, x, y, q, label, second);
+        }
+}
+
+/// Guided filtering of cost with gray guide, from its moments, and winner
+/// takes all selection.
+///
+/// Same as filter_color, with scalar variance and coefficient a.
+template <class Coef>
+static void filter_gray(Image meanCost, Image covar,
+                        Image guideGray, const GuideStats& guide,
+                        int r, int s, Coef coef[2], Workspace& ws,
+                        Image& cost, Labels& labels, unsigned short label,
+                        SecondBest* second) {
+    const int w=meanCost.width(), h=meanCost.height();
+    const int width=guideGray.width(), height=guideGray.height();
+    ProfileTimer timer("linear_model");
+    Coef &offset=coef[0], &a=coef[1];
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            a(x,y) = covar(x,y) * guide.invRR(x,y);
+            offset(x,y) = meanCost(x,y) - a(x,y)*guide.meanR(x,y);
+        }
+    const Coef* in[2] = {&offset, &a};
+    box_coefficients(in, 2, r, ws);
+    Image* out = ws.mean;
+    if(s > 1) {
+        for(int i=0; i<2; i++)
+            ws.mean[i].upsample(s, ws.up[i], ws.x0, ws.fx);
+        out = ws.up;
+    }
+    Image b=out[0], meanA=out[1];
+    timer.stop();
+    ProfileTimer timerWTA("wta");
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(width,height))
+#endif
+    for(int y=0; y<height; y++)
+        for(int x=0; x<width; x++)
+            select_label(cost, labels, x, y,
+                         b(x,y) + meanA(x,y)*guideGray(x,y), label, second);
+}
+
+/// Guided filtering of cost from its moments and winner takes all selection,
+/// see filter_color and filter_gray.
+template <class Coef>
+static void filter(Image meanCost, const Image covar[3],
+                   Image im1Color, Image gray1, const GuideStats& guide,
+                   int r, int s, Coef coef[4], Workspace& ws,
+                   Image& cost, Labels& labels, unsigned short label,
+                   SecondBest* second) {
+    if(guide.channels == 1)
+        filter_gray<Coef>(meanCost, covar[0], gray1, guide, r, s, coef, ws,
+                          cost, labels, label, second);
+    else
+        filter_color<Coef>(meanCost, covar, im1Color, guide, r, s, coef, ws,
+                           cost, labels, label, second);
+}
+
+/// Confidence of the disparities selected with filtered costs \a cost:
+/// difference with the lowest cost \a second at disparities not adjacent to
+/// the selected one, relative to the max cost \a maxCost, in [0,1].
+///
+/// A flat or repetitive cost profile has low confidence. Without any other
+/// disparity at distance at least 2 of the selected one, the confidence is 1.
+/// The map is computed in place in \a second, to spare an image while the
+/// workspace of the tile is alive.
+static Image confidence_map(Image cost, Image second, float maxCost) {
+    const int w=cost.width(), h=cost.height();
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            float c = 1;
+            if(second(x,y) < std::numeric_limits<float>::max() && maxCost>0)
+                c = std::min(1.0f, (second(x,y)-cost(x,y))/maxCost);
+            second(x,y) = std::max(0.0f, c);
+        }
+    return second;
+}
+
+/// Cost volume filtering of a tile of im1 in range [dispMin,dispMax].
+///
+/// The tile of im1 starts at abscissa \a x1 in full image of width
+/// \a fullWidth, the tile of im2 (same rows) at abscissa \a x2. \a guide holds
+/// the statistics of the tile of the guide (\a im1Color, or \a gray1 if
+/// param.gray_guide), subsampled if param.subsample>1.
+/// The images \a disparity and \a cost are updated where a disparity in the
+/// range gets lower filtered cost. The selected disparities are kept as 16-bit
+/// labels during the loop, so the range must have less than 65536 values.
+///
+/// With subsampling (fast guided filter), the coefficients of the linear model
+/// are computed on the subsampled guide and costs, and their averages are
+/// upsampled before applying them to the full resolution guide.
+///
+/// If \a confidence is not null, it gets the confidence map of the tile, see
+/// confidence_map.
+static void filter_tile(Image im1Color, Image gray1, Image gradient1,
+                        const GuideStats& guide,
+                        Image im2Color, Image gradient2,
+                        int x1, int x2, int fullWidth,
+                        int dispMin, int dispMax,
+                        const ParamGuidedFilter& param,
+                        Image& disparity, Image& cost, Progress* progress,
+                        Image* confidence) {
     Image im1R=im1Color.r(), im1G=im1Color.g(), im1B=im1Color.b();
     Image im2R=im2Color.r(), im2G=im2Color.g(), im2B=im2Color.b();
     const int width=im1R.width(), height=im1R.height();
-    const int r = param.kernel_radius;
-    std::cout << "Cost-volume: " << (dispMax-dispMin+1) << " disparities. ";
+    const int s = std::max(1, param.subsample);
+    const int r = subsampled_radius(param);
+    Image guideIm = param.gray_guide? gray1: im1Color;
+    if(s > 1)
+        guideIm = guideIm.downsample(s, param.gray_guide? 1: 3);
 
+    // Fixed point: 8-bit images, integer costs and sums in patches
+    const bool fixed = fixed_point(param);
+    FixedImage fixed1(fixed? im1Color: Image(), gradient1);
+    FixedImage fixed2(fixed? im2Color: Image(), gradient2);
+    FixedGuide fixedGuide(fixed? guideIm: Image(), guide.channels, r);
+    FixedCost fixedCost(fixedGuide, param);
+
+    // Compact storage: costs on 16 bits if not subsampled, FP16 coefficients
+    const bool compact = param.compact_storage;
+    const bool quantize = quantized(param);
+    const float maxCost = (1-param.alpha)*param.color_threshold +
+                          param.alpha*param.gradient_threshold;
+    QuantizedCost qCost(quantize? width: 0, quantize? height: 0, maxCost);
+    Image dCost = (quantize||fixed)? Image(): Image(width,height);
+
+    Workspace ws(WorkspaceLayout(width, height, guide.channels, param));
+    Image& meanCost = ws.moments[0];
+    Image* covar = ws.moments+1;
+    Labels labels(width*height, 0);
+    SecondBest* second = confidence? new SecondBest(width,height): 0;
+    for(int d=dispMin; d<=dispMax; d++) {
+        ProfileTimer timerCost("cost");
+        if(fixed)
+            fixed_cost(fixed1, fixed2, d, x1, x2, fullWidth, fixedCost);
+        else if(quantize)
+            compute_cost(im1R,im1G,im1B, im2R,im2G,im2B, gradient1, gradient2,
+                         d, x1, x2, fullWidth, param, qCost);
+        else
+            compute_cost(im1R,im1G,im1B, im2R,im2G,im2B, gradient1, gradient2,
+                         d, x1, x2, fullWidth, param, dCost);
+        timerCost.stop();
+
+        ProfileTimer timerMoments("moments");
+        if(fixed)
+            fixed_moments(fixedCost, fixedGuide, meanCost, covar);
+        else if(quantize)
+            moments(qCost, guideIm, guide, r, ws);
+        else if(s > 1) {
+            dCost.downsample(s, ws.costSub);
+            moments(ws.costSub, guideIm, guide, r, ws);
+        } else
+            moments(dCost, guideIm, guide, r, ws);
+        timerMoments.stop();
+
+        const unsigned short label = static_cast<unsigned short>(d-dispMin+1);
+        if(compact)
+            filter(meanCost, covar, im1Color, gray1, guide, r, s, ws.half, ws,
+                   cost, labels, label, second);
+        else
+            filter(meanCost, covar, im1Color, gray1, guide, r, s, ws.coef, ws,
+                   cost, labels, label, second);
+        const float done = static_cast<float>(d-dispMin+1)/(dispMax-dispMin+1);
+        if(progress && ! progress->report("cost_volume", done)) {
+            delete second;
+            return;
+        }
+    }
+    if(second) {
+        *confidence = confidence_map(cost, second->second, maxCost);
+        delete second;
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(width,height))
+#endif
+    for(int y=0; y<height; y++)
+        for(int x=0; x<width; x++)
+            if(labels[y*width+x])
+                disparity(x,y) = static_cast<float>(dispMin-1 +
+                                                    labels[y*width+x]);
+}
+
+/// Bytes of the buffers of filter_tile for a tile of \a width x \a height with
+/// a guide of \a channels, \a confidence telling whether the confidence map
+/// is computed. The tile of im2 is assumed of the same size.
+static long long tile_memory(int width, int height, int channels,
+                             const ParamGuidedFilter& param, bool confidence) {
+    const int s = std::max(1, param.subsample);
+    const int ws=(width+s-1)/s, hs=(height+s-1)/s;
+    long long m = WorkspaceLayout(width, height, channels, param).memory() +
+        Labels::memory(static_cast<long long>(width)*height);
+    if(s > 1) // Subsampled guide
+        m += Image::memory(ws, channels*hs);
+    if(fixed_point(param))
+        m += 2*FixedImage::memory(width,height) +
+            FixedGuide::memory(width,height,channels) +
+            FixedCost::memory(width,height);
+    else if(quantized(param))
+        m += CompactImage<unsigned short>::memory(width,height);
+    else
+        m += Image::memory(width,height); // Cost
+    if(confidence) // SecondBest
+        m += 3*Image::memory(width,height);
+    return m;
+}
+
+/// Statistics of image of \a view in \a pair as guide (color, or gray level if
+/// param.gray_guide), at resolution of the coefficients of the linear model.
+static GuideStats guide_statistics(StereoPairContext& pair, int view,
+                                   const ParamGuidedFilter& param) {
+    return pair.guide(view, param.gray_guide? 1: 3,
+                      std::max(1, param.subsample), subsampled_radius(param),
+                      param.epsilon);
+}
+
+/// Cost volume filtering
+///
+/// Progress is reported to \a progress, if not null, after each disparity.
+/// If cancelled, the returned image is empty.
+/// If \a confidence is not null, it gets the confidence of each disparity in
+/// [0,1], from the margin between the two lowest filtered costs at
+/// non-adjacent disparities. It costs 3 more images during the loop.
+///
+/// The images do not go through the cache of guidance: callers processing the
+/// same images again (server, sequences) opt in with a StereoPairContext
+/// built with cache.
+Image filter_cost_volume(Image im1Color, Image im2Color,
+                         int dispMin, int dispMax,
+                         const ParamGuidedFilter& param, Progress* progress,
+                         Image* confidence) {
+    StereoPairContext pair(im1Color, im2Color);
+    return filter_cost_volume(pair, 0, dispMin, dispMax, param, progress,
+                              confidence);
+}
+
+/// Cost volume filtering of image of \a view in \a pair, matched with the
+/// other image.
+///
+/// The range [dispMin,dispMax] is for the disparities of this image, so for
+/// view 1 (im2) it is the opposite of the range of im1. The features and
+/// statistics of the images are taken from \a pair, so they are computed once
+/// for both views.
+Image filter_cost_volume(StereoPairContext& pair, int view,
+                         int dispMin, int dispMax,
+                         const ParamGuidedFilter& param, Progress* progress,
+                         Image* confidence) {
+    Image im1Color=pair.image(view), im2Color=pair.image(1-view);
+    const int width=im1Color.width(), height=im1Color.height();
     Image disparity(width,height);
     std::fill_n(&disparity(0,0), width*height, static_cast<float>(dispMin-1));
     Image cost(width,height);
     std::fill_n(&cost(0,0), width*height, std::numeric_limits<float>::max());
 
-    Image im1Gray(width,height);
-    Image im2Gray(width,height);
-    rgb_to_gray(&im1R(0,0),&im1G(0,0),&im1B(0,0), width,height, &im1Gray(0,0));
-    rgb_to_gray(&im2R(0,0),&im2G(0,0),&im2B(0,0), width,height, &im2Gray(0,0));
-    Image gradient1 = im1Gray.gradX();
-    Image gradient2 = im2Gray.gradX();
-
-    // Compute the mean and variance of each patch, eq. (14)
-    Image meanIm1R = im1R.boxFilter(r);
-    Image meanIm1G = im1G.boxFilter(r);
-    Image meanIm1B = im1B.boxFilter(r);
-
-    Image varIm1RR = covariance(im1R, meanIm1R, im1R, meanIm1R, r);
-    Image varIm1RG = covariance(im1R, meanIm1R, im1G, meanIm1G, r);
-    Image varIm1RB = covariance(im1R, meanIm1R, im1B, meanIm1B, r);
-    Image varIm1GG = covariance(im1G, meanIm1G, im1G, meanIm1G, r);
-    Image varIm1GB = covariance(im1G, meanIm1G, im1B, meanIm1B, r);
-    Image varIm1BB = covariance(im1B, meanIm1B, im1B, meanIm1B, r);
-
-    Image aR(width,height),aG(width,height),aB(width,height);
-    Image dCost(width,height);
-    for(int d=dispMin; d<=dispMax; d++) {
-        std::cout << '*' << std::flush;
-        compute_cost(im1R,im1G,im1B, im2R,im2G,im2B, gradient1, gradient2,
-                     d, param, dCost);
-        Image meanCost = dCost.boxFilter(r); // Eq. (14)
+    ImageFeatures features1 = pair.features(view);
+    Image gradient2 = pair.features(1-view).gradient;
 
-        Image covarIm1RCost = covariance(im1R, meanIm1R, dCost, meanCost, r);
-        Image covarIm1GCost = covariance(im1G, meanIm1G, dCost, meanCost, r);
-        Image covarIm1BCost = covariance(im1B, meanIm1B, dCost, meanCost, r);
+    // Means and inverse of regularized covariance of patches of guide
+    GuideStats guide = guide_statistics(pair, view, param);
 
-        for(int y=0; y<height; y++)
-            for(int x=0; x<width; x++) {
-                // Computation of (Sigma_k+\epsilon Id)^{-1}
-                float S1[3*3] = { // Eq. (21)
-                    varIm1RR(x,y)+param.epsilon, varIm1RG(x,y), varIm1RB(x,y),
-                    varIm1RG(x,y), varIm1GG(x,y)+param.epsilon, varIm1GB(x,y),
-                    varIm1RB(x,y), varIm1GB(x,y), varIm1BB(x,y)+param.epsilon };
-                float S2[3*3];
-                inverseSym3(S1, S2);
-                // Eq. (19)
-                aR(x,y) = covarIm1RCost(x,y) * S2[0] +
-                          covarIm1GCost(x,y) * S2[1] +
-                          covarIm1BCost(x,y) * S2[2];
-                aG(x,y) = covarIm1RCost(x,y) * S2[3] +
-                          covarIm1GCost(x,y) * S2[4] +
-                          covarIm1BCost(x,y) * S2[5];
-                aB(x,y) = covarIm1RCost(x,y) * S2[6] +
-                          covarIm1GCost(x,y) * S2[7] +
-                          covarIm1BCost(x,y) * S2[8];
+    profile_count("disparities", dispMax-dispMin+1);
+    filter_tile(im1Color, features1.gray, features1.gradient, guide,
+                im2Color, gradient2, 0, 0, width,
+                dispMin, dispMax, param, disparity, cost, progress,
+                confidence);
+    if(progress && progress->cancelled())
+        return Image();
+    return disparity;
+}
+
+/// Cost volume filtering of image of \a view in \a pair restricted to the
+/// rectangle of top-left corner (\a x0,\a y0) and size \a w x \a h.
+///
+/// Only the rectangle with the margin of the filters is read in the image of
+/// \a view, and in the other image only the same rows at columns shifted by
+/// the disparity range. The features and guide statistics are computed on
+/// these crops, not taken from \a pair, so that time and memory are
+/// proportional to the area of the rectangle. The disparities are those of
+/// filter_cost_volume in the rectangle, up to rounding errors in sums.
+///
+/// The result and \a confidence, if not null, have size \a w x \a h.
+/// Progress is reported like filter_cost_volume.
+Image filter_cost_volume_roi(StereoPairContext& pair, int view,
+                             int dispMin, int dispMax,
+                             int x0, int y0, int w, int h,
+                             const ParamGuidedFilter& param,
+                             Progress* progress, Image* confidence) {
+    Image im1Color=pair.image(view), im2Color=pair.image(1-view);
+    const int width=im1Color.width(), height=im1Color.height();
+    const int s = std::max(1, param.subsample);
+    const int channels = param.gray_guide? 1: 3;
+    const int margin = tile_margin(param);
+
+    // Rectangle of im1 with margin (aligned on subsampling blocks), and
+    // columns of im2 it may be matched with. One more column since the
+    // derivative at the border of the crop is not the one of the full image.
+    int X0=std::max(0,x0-margin-1), X1=std::min(width, x0+w+margin+1);
+    int Y0=std::max(0,y0-margin),   Y1=std::min(height,y0+h+margin);
+    X0 -= X0%s; X1 = std::min(width, (X1+s-1)/s*s);
+    Y0 -= Y0%s; Y1 = std::min(height,(Y1+s-1)/s*s);
+    const int X2 = std::min(std::max(0,X0+dispMin), width-1);
+    const int X3 = std::max(std::min(width,X1+dispMax), X2+1);
+    const int w1=X1-X0, h1=Y1-Y0, w2=X3-X2;
+    Image crop1 = im1Color.crop(X0,Y0,w1,h1,3);
+    Image crop2 = im2Color.crop(X2,Y0,w2,h1,3);
+    ImageFeatures features1 = image_features(crop1);
+    Image gradient2 = image_features(crop2).gradient;
+
+    Image guideIm = param.gray_guide? features1.gray: crop1;
+    if(s > 1)
+        guideIm = guideIm.downsample(s, channels);
+    GuideStats guide = guide_statistics(guideIm, subsampled_radius(param),
+                                        std::vector<float>(1,param.epsilon),
+                                        channels).front();
+
+    Image disp(w1,h1), cost(w1,h1), conf;
+    std::fill_n(&disp(0,0), w1*h1, static_cast<float>(dispMin-1));
+    std::fill_n(&cost(0,0), w1*h1, std::numeric_limits<float>::max());
+    profile_count("disparities", dispMax-dispMin+1);
+    profile_count("roi_pixels", static_cast<long>(w)*h);
+    filter_tile(crop1, param.gray_guide? features1.gray: Image(),
+                features1.gradient, guide, crop2, gradient2,
+                X0, X2, width, dispMin, dispMax, param, disp, cost, progress,
+                confidence? &conf: 0);
+    if(progress && progress->cancelled())
+        return Image();
+    if(confidence)
+        *confidence = conf.crop(x0-X0, y0-Y0, w, h);
+    return disp.crop(x0-X0, y0-Y0, w, h);
+}
+
+/// Do \a p and \a q have the same matching cost?
+static bool same_cost(const ParamGuidedFilter& p, const ParamGuidedFilter& q) {
+    return p.alpha==q.alpha && p.color_threshold==q.color_threshold &&
+           p.gradient_threshold==q.gradient_threshold;
+}
+
+/// Cost volume filtering of image of \a view in \a pair with each parameters
+/// of \a params, returning the disparity maps in the same order.
+///
+/// The parameters are grouped by matching cost (alpha and thresholds), each
+/// group being a single loop on disparities. In this loop, the cost of a
+/// disparity is computed once, its moments (mean and covariances with the
+/// guide) once per radius, and only the linear model and the winner takes all
+/// selection for each epsilon. The statistics of the guide are computed once
+/// per radius for all epsilons. All parameters must have the same guide and
+/// subsampling, and neither compact storage nor fixed point.
+std::vector<Image> filter_cost_volume_sweep(
+    StereoPairContext& pair, int view, int dispMin, int dispMax,
+    const std::vector<ParamGuidedFilter>& params, Progress* progress) {
+    Image im1Color=pair.image(view), im2Color=pair.image(1-view);
+    Image im1R=im1Color.r(), im1G=im1Color.g(), im1B=im1Color.b();
+    Image im2R=im2Color.r(), im2G=im2Color.g(), im2B=im2Color.b();
+    const int width=im1R.width(), height=im1R.height();
+    ImageFeatures features1 = pair.features(view);
+    Image gradient1 = features1.gradient;
+    Image gradient2 = pair.features(1-view).gradient;
+    const ParamGuidedFilter& param0 = params.front();
+    const int s = std::max(1, param0.subsample);
+    const int channels = param0.gray_guide? 1: 3;
+    Image guideIm = param0.gray_guide? features1.gray: im1Color;
+    if(s > 1)
+        guideIm = guideIm.downsample(s, channels);
+    const int n = static_cast<int>(params.size());
+
+    // Statistics of guide: stats[which[i]] for params[i]
+    std::vector<GuideStats> stats;
+    std::vector<int> which(n, -1);
+    for(int i=0; i<n; i++) {
+        if(which[i] >= 0)
+            continue;
+        const int r = subsampled_radius(params[i]);
+        std::vector<float> eps;
+        for(int k=i; k<n; k++)
+            if(subsampled_radius(params[k]) == r) {
+                which[k] = static_cast<int>(stats.size() + eps.size());
+                eps.push_back(params[k].epsilon);
             }
-        Image b = (meanCost-aR*meanIm1R-aG*meanIm1G-aB*meanIm1B).boxFilter(r);
-        b += aR.boxFilter(r)*im1R+aG.boxFilter(r)*im1G+aB.boxFilter(r)*im1B;
+        std::vector<GuideStats> st=guide_statistics(guideIm, r, eps, channels);
+        stats.insert(stats.end(), st.begin(), st.end());
+    }
 
-        // Winner takes all label selection
+    // Groups of same matching cost, ordered by radius inside a group
+    std::vector< std::vector<int> > groups;
+    std::vector<bool> grouped(n, false);
+    for(int i=0; i<n; i++) {
+        if(grouped[i])
+            continue;
+        std::vector<int> group;
+        for(int j=i; j<n; j++) {
+            if(grouped[j] || ! same_cost(params[i], params[j]))
+                continue;
+            for(int k=j; k<n; k++)
+                if(! grouped[k] && same_cost(params[i], params[k]) &&
+                   subsampled_radius(params[k])==subsampled_radius(params[j])){
+                    grouped[k] = true;
+                    group.push_back(k);
+                }
+        }
+        groups.push_back(group);
+    }
+
+    std::vector<Image> cost(n);
+    std::vector<Labels> labels(n, Labels(width*height, 0));
+    for(int i=0; i<n; i++) {
+        cost[i] = Image(width,height);
+        std::fill_n(&cost[i](0,0), width*height,
+                    std::numeric_limits<float>::max());
+    }
+    profile_count("disparities", static_cast<long>(n)*(dispMax-dispMin+1));
+    Image dCost(width,height);
+    Workspace ws(WorkspaceLayout(width, height, channels, param0));
+    const int steps = static_cast<int>(groups.size())*(dispMax-dispMin+1);
+    int step=0;
+    for(size_t g=0; g<groups.size(); g++)
+        for(int d=dispMin; d<=dispMax; d++) {
+            const std::vector<int>& group = groups[g];
+            ProfileTimer timerCost("cost");
+            compute_cost(im1R,im1G,im1B, im2R,im2G,im2B, gradient1, gradient2,
+                         d, 0, 0, width, params[group[0]], dCost);
+            if(s > 1)
+                dCost.downsample(s, ws.costSub);
+            timerCost.stop();
+            const unsigned short label=static_cast<unsigned short>(d-dispMin+1);
+            for(size_t k=0; k<group.size(); k++) {
+                const int i = group[k];
+                const int r = subsampled_radius(params[i]);
+                if(k==0 || r!=subsampled_radius(params[group[k-1]])) {
+                    ProfileTimer timerMoments("moments");
+                    moments((s>1)? ws.costSub: dCost, guideIm,
+                            stats[which[i]], r, ws);
+                }
+                filter(ws.moments[0], ws.moments+1, im1Color, features1.gray,
+                       stats[which[i]], r, s, ws.coef, ws,
+                       cost[i], labels[i], label, 0);
+            }
+            if(progress && ! progress->report("cost_volume",
+                                              static_cast<float>(++step)/steps))
+                return std::vector<Image>();
+        }
+
+    std::vector<Image> disparity(n);
+    for(int i=0; i<n; i++) {
+        disparity[i] = Image(width,height);
         for(int y=0; y<height; y++)
             for(int x=0; x<width; x++)
-                if(cost(x,y) >= b(x,y)) {
-                    cost(x,y) = b(x,y);
-                    disparity(x,y) = static_cast<float>(d);
-                }
+                disparity[i](x,y) = static_cast<float>(dispMin-1 +
+                                                       labels[i][y*width+x]);
+    }
+    return disparity;
+}
+
+/// Predicted peak memory (bytes) of images and buffers allocated by
+/// filter_cost_volume for input images of size \a width x \a height, with
+/// the \a confidence map or not. Input images are not counted.
+///
+/// The peak is reached in the loop on disparities, where all buffers are
+/// alive: the disparity and cost maps, the features of both images, the
+/// statistics of the guide and the buffers of filter_tile. The sizes come
+/// from the functions used by the allocations. No buffer depends on the
+/// radius (box filters use integral images or running sums) nor on the
+/// disparity range (labels are 16-bit whatever the range, costs are computed
+/// one disparity at a time).
+long long filter_cost_volume_memory(int width, int height,
+                                    const ParamGuidedFilter& param,
+                                    bool confidence) {
+    const int s = std::max(1, param.subsample);
+    const int channels = param.gray_guide? 1: 3;
+    return 2*Image::memory(width,height) +
+        2*ImageFeatures::memory(width,height) +
+        GuideStats::memory((width+s-1)/s, (height+s-1)/s, channels) +
+        tile_memory(width, height, channels, param, confidence);
+}
+
+/// Range of disparities of \a prevDisparity in rectangle [x0,x1)x[y0,y1)
+/// dilated by \a warm.dilation and extended by \a warm.tolerance.
+///
+/// Only the values in [dispMin,dispMax] are considered, and those appearing in
+/// less than 1% of pixels are ignored as outliers. If there is none, the full
+/// range is returned.
+static void warm_range(Image prevDisparity, int x0, int y0, int x1, int y1,
+                       int dispMin, int dispMax, const ParamWarmStart& warm,
+                       int& dMin, int& dMax) {
+    x0 = std::max(0, x0-warm.dilation);
+    y0 = std::max(0, y0-warm.dilation);
+    x1 = std::min(prevDisparity.width(),  x1+warm.dilation);
+    y1 = std::min(prevDisparity.height(), y1+warm.dilation);
+    std::vector<int> histo(dispMax-dispMin+1, 0);
+    for(int y=y0; y<y1; y++)
+        for(int x=x0; x<x1; x++) {
+            float d = prevDisparity(x,y);
+            if(dispMin<=d && d<=dispMax)
+                ++histo[static_cast<int>(d)-dispMin];
+        }
+    const int minCount = std::max(1, (x1-x0)*(y1-y0)/100);
+    int m=0, M=static_cast<int>(histo.size())-1;
+    while(m<=M && histo[m]<minCount) ++m;
+    while(m<=M && histo[M]<minCount) --M;
+    dMin=dispMin; dMax=dispMax;
+    if(m <= M) {
+        dMin = std::max(dispMin, dispMin+m-warm.tolerance);
+        dMax = std::min(dispMax, dispMin+M+warm.tolerance);
+    }
+}
+
+/// Cost volume filtering with disparity search restricted by the disparity
+/// map \a prevDisparity of the previous frame.
+///
+/// The image is split in square tiles of size \a warm.tile, each one searching
+/// only the disparities found in the previous frame in the tile, see
+/// warm_range. Each tile is filtered with a margin of twice the radius, so that
+/// the result is the same as filter_cost_volume restricted to the range of the
+/// tile. With subsampling, tiles are aligned on subsampling blocks.
+///
+/// Progress is reported to \a progress, if not null, after each tile. If
+/// cancelled, the returned image is empty.
+/// The \a confidence map, if not null, is computed in the range of each tile.
+/// As filter_cost_volume, it does not use the cache of guidance.
+Image filter_cost_volume_warm(Image im1Color, Image im2Color,
+                              int dispMin, int dispMax, Image prevDisparity,
+                              const ParamGuidedFilter& param,
+                              const ParamWarmStart& warm, Progress* progress,
+                              Image* confidence) {
+    StereoPairContext pair(im1Color, im2Color);
+    return filter_cost_volume_warm(pair, 0, dispMin, dispMax, prevDisparity,
+                                   param, warm, progress, confidence);
+}
+
+/// Cost volume filtering of image of \a view in \a pair with warm start,
+/// see filter_cost_volume.
+Image filter_cost_volume_warm(StereoPairContext& pair, int view,
+                              int dispMin, int dispMax, Image prevDisparity,
+                              const ParamGuidedFilter& param,
+                              const ParamWarmStart& warm, Progress* progress,
+                              Image* confidence) {
+    Image im1Color=pair.image(view), im2Color=pair.image(1-view);
+    const int width=im1Color.width(), height=im1Color.height();
+    const int s = std::max(1, param.subsample);
+    const int margin = tile_margin(param);
+    const int tile = std::max(1, warm.tile);
+    const int nx = (width+tile-1)/tile, ny = (height+tile-1)/tile;
+
+    Image disparity(width,height);
+    if(confidence)
+        *confidence = Image(width,height);
+    ImageFeatures features1 = pair.features(view);
+    Image gray1=features1.gray, gradient1=features1.gradient;
+    Image gradient2 = pair.features(1-view).gradient;
+    GuideStats guide = guide_statistics(pair, view, param);
+
+    long long nEvaluated=0; // Number of evaluated pixel-disparities
+    int nDone=0; // Number of tiles done
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:nEvaluated)
+#endif
+    for(int t=0; t<nx*ny; t++) {
+#ifdef _OPENMP
+        omp_set_num_threads(1); // Tiles are already processed in parallel
+#endif
+        if(progress && progress->cancelled())
+            continue;
+        const int x0=(t%nx)*tile, y0=(t/nx)*tile;
+        const int x1=std::min(width,x0+tile), y1=std::min(height,y0+tile);
+        int dMin, dMax;
+        warm_range(prevDisparity, x0,y0,x1,y1, dispMin,dispMax, warm,
+                   dMin,dMax);
+        nEvaluated += static_cast<long long>(dMax-dMin+1)*(x1-x0)*(y1-y0);
+
+        // Tile of im1 with margin (aligned on subsampling blocks), and
+        // columns of im2 it may be matched with
+        int X0=std::max(0,x0-margin), X1=std::min(width, x1+margin);
+        int Y0=std::max(0,y0-margin), Y1=std::min(height,y1+margin);
+        X0 -= X0%s; X1 = std::min(width, (X1+s-1)/s*s);
+        Y0 -= Y0%s; Y1 = std::min(height,(Y1+s-1)/s*s);
+        const int X2 = std::min(std::max(0,X0+dMin), width-1);
+        const int X3 = std::max(std::min(width,X1+dMax), X2+1);
+        const int w=X1-X0, h=Y1-Y0, w2=X3-X2;
+        Image disp(w,h), cost(w,h), conf;
+        std::fill_n(&disp(0,0), w*h, static_cast<float>(dispMin-1));
+        std::fill_n(&cost(0,0), w*h, std::numeric_limits<float>::max());
+        filter_tile(im1Color.crop(X0,Y0,w,h,3),
+                    param.gray_guide? gray1.crop(X0,Y0,w,h): Image(),
+                    gradient1.crop(X0,Y0,w,h),
+                    guide.crop(X0/s,Y0/s,(w+s-1)/s,(h+s-1)/s),
+                    im2Color.crop(X2,Y0,w2,h,3), gradient2.crop(X2,Y0,w2,h),
+                    X0, X2, width, dMin, dMax, param, disp, cost, 0,
+                    confidence? &conf: 0);
+        for(int y=y0; y<y1; y++)
+            for(int x=x0; x<x1; x++) {
+                disparity(x,y) = disp(x-X0,y-Y0);
+                if(confidence)
+                    (*confidence)(x,y) = conf(x-X0,y-Y0);
+            }
+        if(progress) {
+#ifdef _OPENMP
+#pragma omp critical(progress)
+#endif
+            progress->report("cost_volume",
+                             static_cast<float>(++nDone)/(nx*ny));
+        }
     }
-    std::cout << std::endl;
+    profile_count("tiles", nx*ny);
+    const long long n = static_cast<long long>(width)*height;
+    profile_count("disparities", // Mean per pixel, as for a full search
+                  static_cast<long>((nEvaluated+n/2)/n));
+    if(progress && progress->cancelled())
+        return Image();
     return disparity;
 }
@@ -19,7 +19,10 @@
 #ifndef COSTVOLUME_H
 #define COSTVOLUME_H
 
+#include <vector>
 class Image;
+class Progress;
+class StereoPairContext;
 
 /// Parameters specific to the guided filter
 struct ParamGuidedFilter {
@@ -28,6 +31,10 @@ struct ParamGuidedFilter {
     float alpha;
     int kernel_radius;
     float epsilon;
+    int subsample; ///< Subsampling factor for fast guided filter, 1 for none
+    bool gray_guide; ///< Gray level image as guide instead of color image
+    bool compact_storage; ///< 16-bit costs and FP16 coefficients
+    bool fixed_point; ///< Integer costs and sums in patches
 
     /// Constructor with default parameters
     ParamGuidedFilter()
@@ -35,11 +42,54 @@ struct ParamGuidedFilter {
       gradient_threshold(2),
       alpha(1-0.1f),
       kernel_radius(9),
-      epsilon(0.0001f*255*255) {}
+      epsilon(0.0001f*255*255),
+      subsample(1),
+      gray_guide(false),
+      compact_storage(false),
+      fixed_point(false) {}
+};
+
+/// Parameters for restriction of the disparity search from previous frame
+struct ParamWarmStart {
+    int tile; ///< Size of square tiles having their own disparity range
+    int dilation; ///< Spatial dilation of previous disparity map
+    int tolerance; ///< Margin added to disparity range of previous frame
+
+    /// Constructor with default parameters
+    ParamWarmStart()
+    : tile(128),
+      dilation(4),
+      tolerance(2) {}
 };
 
 Image filter_cost_volume(Image im1Color, Image im2Color,
                          int dispMin, int dispMax,
-                         const ParamGuidedFilter& param);
+                         const ParamGuidedFilter& param,
+                         Progress* progress=0, Image* confidence=0);
+Image filter_cost_volume_warm(Image im1Color, Image im2Color,
+                              int dispMin, int dispMax, Image prevDisparity,
+                              const ParamGuidedFilter& param,
+                              const ParamWarmStart& warm,
+                              Progress* progress=0, Image* confidence=0);
+Image filter_cost_volume(StereoPairContext& pair, int view,
+                         int dispMin, int dispMax,
+                         const ParamGuidedFilter& param,
+                         Progress* progress=0, Image* confidence=0);
+Image filter_cost_volume_warm(StereoPairContext& pair, int view,
+                              int dispMin, int dispMax, Image prevDisparity,
+                              const ParamGuidedFilter& param,
+                              const ParamWarmStart& warm,
+                              Progress* progress=0, Image* confidence=0);
+Image filter_cost_volume_roi(StereoPairContext& pair, int view,
+                             int dispMin, int dispMax,
+                             int x0, int y0, int w, int h,
+                             const ParamGuidedFilter& param,
+                             Progress* progress=0, Image* confidence=0);
+std::vector<Image> filter_cost_volume_sweep(
+    StereoPairContext& pair, int view, int dispMin, int dispMax,
+    const std::vector<ParamGuidedFilter>& params, Progress* progress=0);
+long long filter_cost_volume_memory(int width, int height,
+                                    const ParamGuidedFilter& param,
+                                    bool confidence=false);
 
 #endif
@@ -17,6 +17,8 @@
  */
 
 #include "image.h"
+#include "compact.h"
+#include "progress.h"
 #include <algorithm>
 #include <numeric>
 #include <vector>
@@ -27,6 +29,9 @@
 /// line above \a vMin. The filling value is the result of \a cmp with the two
 /// values as parameters.
 void Image::fillX(float vMin, const float& (*cmp)(const float&,const float&)) {
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
     for(int y=0; y<h; y++) {
         int x0=-1;
         float v0 = vMin;
@@ -58,9 +63,12 @@ void Image::fillMaxX(float vMin) {
 Image Image::gradX() const {
     assert(w>=2);
     Image D(w,h);
-    float* out=D.tab;
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
     for(int y=0; y<h; y++) {
         const float* in=tab+y*w;
+        float* out=D.tab+y*w;
         *out++ = in[1]-in[0];           // Right - current
         for(int x=1; x+1<w; x++, in++)
             *out++ = .5f*(in[2]-in[0]); // Right - left
@@ -69,57 +77,379 @@ Image Image::gradX() const {
     return D;
 }
 
-/// Averaging filter with box of \a radius.
+/// Averaging filter with box of \a radius of \a n images \a in[i] of
+/// dimensions \a w x \a h, output values multiplied by \a scale.
 ///
 /// Use the integral image for fast computation. The integral image is of type
 /// double to mitigate risks of precision loss for large images.
-Image Image::boxFilter(int radius) const {
-    double* S = new double[w*h]; // Use double to mitigate precision loss
-    for(int i=w*h-1; i>=0; i--)
-        S[i] = static_cast<double>(tab[i]);
+/// The integral images of the \a n inputs are interleaved, so that each row is
+/// swept once for all images and the bounds of boxes are computed once. The
+/// result is the same as filtering each image separately.
+/// The horizontal cumulative sums and the output are computed by rows in
+/// parallel, the vertical cumulative sums by bands of columns. The integral
+/// images are stored in buffer \a S of n*w*h values.
+template <int n, class T>
+static void box_filter(const T* const* in, int w, int h, int radius,
+                       double scale, float* const* out, double* S) {
 
     //cumulative sum table S, eq. (24)
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
     for(int y=0; y<h; y++) { //horizontal
-        double *in=S+y*w, *out=in+1;
+        double *O=S+static_cast<size_t>(n)*y*w;
+        for(int i=0; i<n; i++)
+            O[i] = static_cast<double>(static_cast<float>(in[i][y*w]));
         for(int x=1; x<w; x++)
-            *out++ += *in++;
+            for(int i=0; i<n; i++)
+                O[n*x+i] = O[n*(x-1)+i] +
+                    static_cast<double>(static_cast<float>(in[i][y*w+x]));
     }
-    for(int y=1; y<h; y++) { //vertical
-        double *in=S+(y-1)*w, *out=in+w;
-        for(int x=0; x<w; x++)
-            *out++ += *in++;
+    const int band=64; // Columns of a band for vertical sums
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int x0=0; x0<n*w; x0+=band) { //vertical
+        const int x1=std::min(n*w,x0+band);
+        for(int y=1; y<h; y++) {
+            const double *I=S+static_cast<size_t>(n)*(y-1)*w;
+            double *O=S+static_cast<size_t>(n)*y*w;
+            for(int x=x0; x<x1; x++)
+                O[x] += I[x];
+        }
     }
 
-    //box filtered image B
-    Image B(w,h);
-    float *out=B.tab;
+    //box filtered images
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
     for(int y=0; y<h; y++) {
         int ymin = std::max(-1, y-radius-1);
         int ymax = std::min(h-1, y+radius);
-        for(int x=0; x<w; x++, out++) {
+        const double* Smax = S+static_cast<size_t>(n)*ymax*w;
+        const double* Smin = S+static_cast<size_t>(n)*std::max(0,ymin)*w;
+        for(int x=0; x<w; x++) {
             int xmin = std::max(-1, x-radius-1);
             int xmax = std::min(w-1, x+radius);
-            // S(xmax,ymax)-S(xmin,ymax)-S(xmax,ymin)+S(xmin,ymin), eq. (25)
-            double val = S[ymax*w+xmax];
-            if(xmin>=0)
-                val -= S[ymax*w+xmin];
-            if(ymin>=0)
-                val -= S[ymin*w+xmax];
-            if(xmin>=0 && ymin>=0)
-                val += S[ymin*w+xmin];
-            *out = static_cast<float>(val/((xmax-xmin)*(ymax-ymin))); //average
+            const int area = (xmax-xmin)*(ymax-ymin);
+            for(int i=0; i<n; i++) {
+                // S(xmax,ymax)-S(xmin,ymax)-S(xmax,ymin)+S(xmin,ymin), (25)
+                double val = Smax[n*xmax+i];
+                if(xmin>=0)
+                    val -= Smax[n*xmin+i];
+                if(ymin>=0)
+                    val -= Smin[n*xmax+i];
+                if(xmin>=0 && ymin>=0)
+                    val += Smin[n*xmin+i];
+                val /= area; //average
+                out[i][y*w+x] = static_cast<float>(val*scale);
+            }
         }
     }
-    delete [] S;
+}
+
+/// Box filters of a group of \a n<=4 images, see box_filter above.
+///
+/// The number of images of a group is a template parameter, so that the
+/// loops on images are unrolled. The buffer \a S is enlarged if needed.
+template <class T>
+static void box_group(const T* const* in, int n, int w, int h, int radius,
+                      double scale, float* const* out,
+                      TrackedVector<double>& S) {
+    if(S.size() < static_cast<size_t>(n)*w*h)
+        S.resize(static_cast<size_t>(n)*w*h);
+    switch(n) {
+    case 1: box_filter<1>(in, w, h, radius, scale, out, &S[0]); break;
+    case 2: box_filter<2>(in, w, h, radius, scale, out, &S[0]); break;
+    case 3: box_filter<3>(in, w, h, radius, scale, out, &S[0]); break;
+    default: box_filter<4>(in, w, h, radius, scale, out, &S[0]); break;
+    }
+}
+
+/// Averaging filter with box of \a radius.
+Image Image::boxFilter(int radius) const {
+    Image B(w,h);
+    const float* in=tab;
+    TrackedVector<double> S;
+    box_group(&in, 1, w, h, radius, 1.0, &B.tab, S);
+    return B;
+}
+
+/// Averaging filter with box of \a radius of the \a n images \a in[i], all
+/// of same size, stored in \a out[i].
+void Image::boxFilter(const Image* const* in, int n, int radius, Image* out) {
+    TrackedVector<double> S;
+    boxFilter(in, n, radius, out, S);
+}
+
+/// Same as above with buffer \a S for integral images, enlarged if needed.
+///
+/// The images \a out[i] of the right size are overwritten, the others are
+/// allocated. They must not share pixels with the inputs. With the same
+/// buffer and outputs, repeated calls make no heap allocation.
+void Image::boxFilter(const Image* const* in, int n, int radius, Image* out,
+                      TrackedVector<double>& S) {
+    for(; n>0; n-=4, in+=4, out+=4) { // Groups of at most 4 images
+        const int k=std::min(n,4), w=in[0]->w, h=in[0]->h;
+        const float* pin[4];
+        float* pout[4];
+        for(int i=0; i<k; i++) {
+            assert(in[i]->w==w && in[i]->h==h);
+            if(out[i].w!=w || out[i].h!=h)
+                out[i] = Image(w,h);
+            pin[i] = in[i]->tab;
+            pout[i] = out[i].tab;
+        }
+        box_group(pin, k, w, h, radius, 1.0, pout, S);
+    }
+}
+
+/// Rows of a band of box_running, whose sums of columns are restarted.
+static const int BAND_ROWS=128;
+
+/// Averaging filter with box of \a radius of \a n images \a in[i] of
+/// dimensions \a w x \a h, output values multiplied by \a scale, with running
+/// sums in float.
+///
+/// The sums of columns in the box are updated from row to row, adding the row
+/// entering the box and subtracting the one leaving it, and each output row is
+/// a sliding sum of them. Contrary to box_filter, no integral image is
+/// stored: inputs are read twice, but only the n*w sums of a band of rows are
+/// written. The rounding errors of float sums are bounded by restarting them
+/// at each band of BAND_ROWS rows. The bands are filtered in parallel, with
+/// their sums in buffer \a S of n*w values per band, followed by w values.
+template <int n, class T>
+static void box_running(const T* const* in, int w, int h, int radius,
+                        float scale, float* const* out, float* S) {
+    const int bands = (h+BAND_ROWS-1)/BAND_ROWS;
+    float* norm = S+static_cast<size_t>(n)*w*bands; // scale/columns in box
+    for(int x=0; x<w; x++)
+        norm[x] = scale/(std::min(w-1,x+radius)-std::max(-1,x-radius-1));
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int b=0; b<bands; b++) {
+        float* col = S+static_cast<size_t>(n)*w*b;
+        const int y0=b*BAND_ROWS, y1=std::min(h,y0+BAND_ROWS);
+        std::fill(col, col+n*w, 0.0f);
+        for(int y=std::max(0,y0-radius); y<=std::min(h-1,y0+radius); y++)
+            for(int x=0; x<w; x++)
+                for(int i=0; i<n; i++)
+                    col[n*x+i] += static_cast<float>(in[i][y*w+x]);
+        for(int y=y0; y<y1; y++) {
+            const float rows = 1.0f/static_cast<float>
+                (std::min(h-1,y+radius)-std::max(-1,y-radius-1));
+            float sum[n];
+            for(int i=0; i<n; i++)
+                sum[i] = 0;
+            for(int x=0; x<=std::min(w-1,radius); x++)
+                for(int i=0; i<n; i++)
+                    sum[i] += col[n*x+i];
+            for(int x=0; x<w; x++) {
+                for(int i=0; i<n; i++)
+                    out[i][y*w+x] = sum[i]*rows*norm[x];
+                if(x+radius+1 < w)
+                    for(int i=0; i<n; i++)
+                        sum[i] += col[n*(x+radius+1)+i];
+                if(x-radius >= 0)
+                    for(int i=0; i<n; i++)
+                        sum[i] -= col[n*(x-radius)+i];
+            }
+            if(y+1 == y1)
+                break;
+            if(y+radius+1 < h) // Row entering the box of next row
+                for(int x=0; x<w; x++)
+                    for(int i=0; i<n; i++)
+                        col[n*x+i] +=
+                            static_cast<float>(in[i][(y+radius+1)*w+x]);
+            if(y-radius >= 0) // Row leaving it
+                for(int x=0; x<w; x++)
+                    for(int i=0; i<n; i++)
+                        col[n*x+i] -= static_cast<float>(in[i][(y-radius)*w+x]);
+        }
+    }
+}
+
+/// Box filters of a group of \a n<=4 images, see box_running above. The
+/// buffer \a S is enlarged if needed.
+template <class T>
+static void box_running_group(const T* const* in, int n, int w, int h,
+                              int radius, float scale, float* const* out,
+                              TrackedVector<float>& S) {
+    const size_t size = CompactImage<T>::boxFilterBuffer(n, w, h);
+    if(S.size() < size)
+        S.resize(size);
+    switch(n) {
+    case 1: box_running<1>(in, w, h, radius, scale, out, &S[0]); break;
+    case 2: box_running<2>(in, w, h, radius, scale, out, &S[0]); break;
+    case 3: box_running<3>(in, w, h, radius, scale, out, &S[0]); break;
+    default: box_running<4>(in, w, h, radius, scale, out, &S[0]); break;
+    }
+}
+
+/// Averaging filter with box of \a radius, values multiplied by \a scale.
+template <class T>
+Image CompactImage<T>::boxFilter(int radius, float scale) const {
+    Image B(w,h);
+    const T* in=&tab[0];
+    float* out=&B(0,0);
+    TrackedVector<float> S;
+    box_running_group(&in, 1, w, h, radius, scale, &out, S);
     return B;
 }
 
+/// Averaging filter with box of \a radius of the \a n images \a in[i], all
+/// of same size, values multiplied by \a scale and stored in \a out[i].
+///
+/// The sums are in float (see box_running), accurate enough for 16-bit
+/// values and much less memory traffic than the double integral images of
+/// Image::boxFilter. The buffer \a S and the images \a out[i] are reused as
+/// in Image::boxFilter.
+template <class T>
+void CompactImage<T>::boxFilter(const CompactImage* const* in, int n,
+                                int radius, Image* out,
+                                TrackedVector<float>& S, float scale) {
+    for(; n>0; n-=4, in+=4, out+=4) { // Groups of at most 4 images
+        const int k=std::min(n,4), w=in[0]->w, h=in[0]->h;
+        const T* pin[4];
+        float* pout[4];
+        for(int i=0; i<k; i++) {
+            assert(in[i]->w==w && in[i]->h==h);
+            if(out[i].width()!=w || out[i].height()!=h)
+                out[i] = Image(w,h);
+            pin[i] = &in[i]->tab[0];
+            pout[i] = &out[i](0,0);
+        }
+        box_running_group(pin, k, w, h, radius, scale, pout, S);
+    }
+}
+
+#ifndef __F16C__
+/// Table of conversions of all half floats to float, filled before main.
+const float* Half::make_table() {
+    static float t[1<<16];
+    for(int h=0; h<(1<<16); h++)
+        t[h] = convert(static_cast<unsigned short>(h));
+    return t;
+}
+const float* const Half::table = Half::make_table();
+#endif
+
+/// Size of the buffer of boxFilter for \a n images of \a width x \a height,
+/// so that it can be allocated beforehand.
+template <class T>
+size_t CompactImage<T>::boxFilterBuffer(int n, int width, int height) {
+    return static_cast<size_t>(std::min(n,4))*width*
+        ((height+BAND_ROWS-1)/BAND_ROWS) + width;
+}
+
+template class CompactImage<unsigned short>;
+template class CompactImage<Half>;
+
+/// Average of blocks of size \a factor x \a factor of \a channels planes of
+/// size \a w x \a h in \a in, written in \a out.
+static void downsample(const float* in, int w, int h, int factor,
+                       int channels, float* out) {
+    const int ws=(w+factor-1)/factor, hs=(h+factor-1)/factor;
+    for(int c=0; c<channels; c++) {
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+        for(int j=0; j<hs; j++) {
+            const int y0=j*factor, y1=std::min(h,y0+factor);
+            float* o = out+(static_cast<size_t>(c)*hs+j)*ws;
+            for(int i=0; i<ws; i++) {
+                const int x0=i*factor, x1=std::min(w,x0+factor);
+                float sum=0;
+                for(int y=y0; y<y1; y++) {
+                    const float* I=in+(c*h+y)*w;
+                    for(int x=x0; x<x1; x++)
+                        sum += I[x];
+                }
+                *o++ = sum/((x1-x0)*(y1-y0));
+            }
+        }
+    }
+}
+
+/// Average of blocks of size \a factor x \a factor.
+///
+/// The last blocks of rows and columns may be incomplete, the output has
+/// dimensions rounded up. For a color image, \a channels should be 3.
+Image Image::downsample(int factor, int channels) const {
+    const int ws=(w+factor-1)/factor, hs=(h+factor-1)/factor;
+    Image D(ws, channels*hs);
+    D.h = hs;
+    ::downsample(tab, w, h, factor, channels, D.tab);
+    return D;
+}
+
+/// Same as above for a single channel, written in \a D, which is allocated
+/// only if its size is not the right one.
+void Image::downsample(int factor, Image& D) const {
+    const int ws=(w+factor-1)/factor, hs=(h+factor-1)/factor;
+    if(D.w!=ws || D.h!=hs)
+        D = Image(ws,hs);
+    ::downsample(tab, w, h, factor, 1, D.tab);
+}
+
+/// Bilinear interpolation of image downsampled by \a factor, to get an image
+/// of dimensions \a width x \a height.
+///
+/// Pixel (i,j) of the current image is at the center of block (i,j) of the
+/// output, as in downsample. Values are extended as constant at borders.
+Image Image::upsample(int factor, int width, int height) const {
+    Image U(width,height);
+    std::vector<int> x0;
+    std::vector<float> fx;
+    upsample(factor, U, x0, fx);
+    return U;
+}
+
+/// Same as above, written in \a U, whose dimensions are the ones of output.
+///
+/// The buffers \a x0 and \a fx of interpolation coefficients along x are
+/// enlarged if needed, so that repeated calls make no heap allocation.
+void Image::upsample(int factor, Image& U,
+                     std::vector<int>& x0, std::vector<float>& fx) const {
+    const int width=U.w, height=U.h;
+    const float shift = .5f*(factor-1);
+    if(x0.size() < static_cast<size_t>(width)) {
+        x0.resize(width);
+        fx.resize(width);
+    }
+    for(int x=0; x<width; x++) {
+        float u = std::min(std::max(0.0f,(x-shift)/factor), float(w-1));
+        x0[x] = std::min(static_cast<int>(u), w-1);
+        fx[x] = u-x0[x];
+    }
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(width,height))
+#endif
+    for(int y=0; y<height; y++) {
+        float* out = U.tab+static_cast<size_t>(y)*width;
+        float v = std::min(std::max(0.0f,(y-shift)/factor), float(h-1));
+        const int y0=std::min(static_cast<int>(v), h-1), y1=std::min(y0+1,h-1);
+        const float fy = v-y0;
+        const float *in0=tab+y0*w, *in1=tab+y1*w;
+        for(int x=0; x<width; x++) {
+            const int i0=x0[x], i1=std::min(i0+1,w-1);
+            float v0 = in0[i0]+fx[x]*(in0[i1]-in0[i0]);
+            float v1 = in1[i0]+fx[x]*(in1[i1]-in1[i0]);
+            *out++ = v0+fy*(v1-v0);
+        }
+    }
+}
+
 /// Median filter, write results in \a M
 void Image::median(int radius, Image& M) const {
     int size=2*radius+1;
     size *= size;
-    float* v = new float[size];
-    for(int y=0; y<h; y++)
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++) {
+        std::vector<float> v(size);
         for(int x=0; x<w; x++) {
             int n=0;
             for(int j=-radius; j<=radius; j++)
@@ -127,10 +457,10 @@ void Image::median(int radius, Image& M) const {
                     for(int i=-radius; i<=radius; i++)
                         if(0<=i+x && i+x<w)
                             v[n++] = (*this)(i+x,j+y);
-            std::nth_element(v, v+n/2, v+n);
+            std::nth_element(v.begin(), v.begin()+n/2, v.begin()+n);
             M(x,y) = v[n/2];
         }
-    delete [] v;
+    }
 }
 
 /// Median filter for a color image
@@ -190,9 +520,12 @@ static int median_histo(const std::vector<float>& tab) {
 /// Image is assumed to have integer values in [vMin,vMax]. Weight are computed
 /// as in bilateral filter in color image \a guidance. Only pixels of image
 /// \a where outside [vMin,vMax] are filtered.
+/// Progress is reported to \a progress, if not null, after each line. If
+/// cancelled, the remaining lines are not computed.
 Image Image::weightedMedianColor(const Image& guidance,
                                  const Image& where, int vMin, int vMax,
-                                 int radius, float sSpace, float sColor) const
+                                 int radius, float sSpace, float sColor,
+                                 Progress* progress) const
 {
     sSpace = 1.0f/(sSpace*sSpace);
     sColor = 1.0f/(sColor*sColor);
@@ -200,11 +533,14 @@ Image Image::weightedMedianColor(const Image& guidance,
     const int size=vMax-vMin+1;
     std::vector<float> tab(size);
     Image M(w,h);
+    int nDone=0; // Number of lines done
 
 #ifdef _OPENMP
 #pragma omp parallel for firstprivate(tab)
 #endif
-    for(int y=0; y<h; y++)
+    for(int y=0; y<h; y++) {
+        if(progress && progress->cancelled())
+            continue;
         for(int x=0; x<w; x++) {
             if(where(x,y)>=vMin) {
                 M(x,y)=(*this)(x,y);
@@ -213,5 +549,13 @@ Image Image::weightedMedianColor(const Image& guidance,
             weighted_histo(tab, x,y, radius, vMin, guidance, sSpace, sColor);
             M(x,y) = static_cast<float>(vMin+median_histo(tab));
         }
+        if(progress) {
+#ifdef _OPENMP
+#pragma omp critical(progress)
+#endif
+            progress->report("weighted_median",
+                             static_cast<float>(++nDone)/h);
+        }
+    }
     return M;
 }
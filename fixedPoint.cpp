@@ -0,0 +1,242 @@
+/**
+ * @file fixedPoint.cpp
+ * @brief Matching costs and their moments in integer arithmetic
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fixedPoint.h"
+#include "costVolume.h"
+#include "image.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+/// Nearest integer of \a v clamped to [0,max].
+static int clamp_round(float v, int max) {
+    if(! (v > 0))
+        return 0;
+    return (v >= max)? max: static_cast<int>(v+0.5f);
+}
+
+/// Sums of \a in in patches of radius \a r, clipped at image boundary.
+///
+/// Separable running sums, exact as long as the sum in a patch fits in int.
+/// The buffers \a rows and \a col have w*h and w values.
+template <class T>
+static void box_sum(const T* in, int w, int h, int r, int* out,
+                    int* rows, int* col) {
+    for(int y=0; y<h; y++) { // Horizontal sums
+        const T* I = in+y*w;
+        int* O = rows+y*w;
+        int s=0;
+        for(int x=0; x<r && x<w; x++)
+            s += I[x];
+        for(int x=0; x<w; x++) {
+            if(x+r < w)
+                s += I[x+r];
+            O[x] = s;
+            if(x-r >= 0)
+                s -= I[x-r];
+        }
+    }
+    std::fill(col, col+w, 0); // Vertical sums, row by row
+    for(int y=0; y<r && y<h; y++)
+        for(int x=0; x<w; x++)
+            col[x] += rows[y*w+x];
+    for(int y=0; y<h; y++) {
+        if(y+r < h)
+            for(int x=0; x<w; x++)
+                col[x] += rows[(y+r)*w+x];
+        std::copy(col, col+w, out+y*w);
+        if(y-r >= 0)
+            for(int x=0; x<w; x++)
+                col[x] -= rows[(y-r)*w+x];
+    }
+}
+
+/// Number of pixels in patches of radius \a r centered at 0..n-1 in 1D.
+static std::vector<int> patch_sizes(int n, int r) {
+    std::vector<int> size(n);
+    for(int i=0; i<n; i++)
+        size[i] = std::min(n-1,i+r) - std::max(0,i-r) + 1;
+    return size;
+}
+
+/// Rounded channels and x-derivative of gray level \a gradient.
+FixedImage::FixedImage(Image color, Image grad)
+: w(color.width()), h(color.height()), rgb(3*w*h), gradient(w*h) {
+    const int n=w*h;
+    if(n == 0)
+        return;
+    const float* in = &color(0,0);
+    for(int i=0; i<3*n; i++)
+        rgb[i] = static_cast<unsigned char>(clamp_round(in[i], 255));
+    const float* D = &grad(0,0);
+    for(int i=0; i<n; i++) {
+        const int v = clamp_round((D[i]<0? -D[i]: D[i])*32, 2*255*16);
+        gradient[i] = static_cast<short>(D[i]<0? -v: v);
+    }
+}
+
+/// Bytes of the buffers of an image of size \a w x \a h.
+long long FixedImage::memory(int w, int h) {
+    const long long n = static_cast<long long>(w)*h;
+    return TrackedVector<unsigned char>::memory(3*n) +
+           TrackedVector<short>::memory(n);
+}
+
+/// Planes of the guide, rounded, and their sums in patches.
+///
+/// The color guide has unit 1, the gray guide unit 1/16.
+FixedGuide::FixedGuide(Image guide, int c, int r)
+: w(guide.width()), h(guide.height()), channels(c), radius(r),
+  maxValue(c==1? 255*16: 255), unit(c==1? 1/16.0f: 1.0f),
+  planes(c*w*h), sums(c*w*h), nx(patch_sizes(w,r)), ny(patch_sizes(h,r)) {
+    if(w*h == 0)
+        return;
+    const float* in = &guide(0,0);
+    for(int i=0; i<c*w*h; i++)
+        planes[i] = static_cast<unsigned short>
+            (clamp_round(in[i]/unit, maxValue));
+    TrackedVector<int> rows(w*h), col(w);
+    for(int i=0; i<channels; i++)
+        box_sum(&planes[i*w*h], w, h, radius, &sums[i*w*h], &rows[0],&col[0]);
+}
+
+/// Bytes of the buffers kept by a guide of size \a w x \a h with \a c
+/// channels, not counting those of the sums freed by the constructor.
+long long FixedGuide::memory(int w, int h, int c) {
+    const long long n = static_cast<long long>(c)*w*h;
+    return TrackedVector<unsigned short>::memory(n) +
+           TrackedVector<int>::memory(n);
+}
+
+/// Fixed point parameters of cost.
+///
+/// Color cost (mean of 3 absolute differences) and gradient cost (unit 1/32)
+/// are both expressed in unit 1/96, and their weighted sum (unit 1/96/4096)
+/// is shifted to fit in the max value allowed by the guide and the radius.
+FixedCost::FixedCost(const FixedGuide& guide, const ParamGuidedFilter& param)
+: colorMax(clamp_round(param.color_threshold*96, 3*255*32)),
+  gradMax(clamp_round(param.gradient_threshold*96, 2*2*255*16*3)),
+  weightColor(4096-clamp_round(param.alpha*4096, 4096)),
+  weightGrad(clamp_round(param.alpha*4096, 4096)),
+  shift(0), unit(0), cost(guide.w*guide.h),
+  sumCost(cost.size()), prod(cost.size()), sumProd(cost.size()),
+  rows(cost.size()), col(guide.w) {
+    const int side = 2*guide.radius+1;
+    const int window =
+        std::max(1, std::min(side,guide.w)*std::min(side,guide.h));
+    const int maxCost = std::max(1, std::min(SHRT_MAX,
+                                             INT_MAX/guide.maxValue/window));
+    const int weighted = weightColor*colorMax + weightGrad*gradMax;
+    while(((weighted + ((1<<shift)>>1)) >> shift) > maxCost)
+        ++shift;
+    unit = static_cast<float>(1<<shift) / (96*4096);
+}
+
+/// Bytes of the buffers of costs of size \a w x \a h: cost, 4 images of
+/// sums and a column.
+long long FixedCost::memory(int w, int h) {
+    const long long n = static_cast<long long>(w)*h;
+    return TrackedVector<short>::memory(n) + TrackedVector<int>::memory(4*n+w);
+}
+
+/// Compute image of matching costs at disparity \a d in fixed point.
+///
+/// Same as compute_cost in costVolume.cpp.
+void fixed_cost(const FixedImage& im1, const FixedImage& im2,
+                int d, int x1, int x2, int fullWidth, FixedCost& cost) {
+    const int w=im1.w, h=im1.h, n1=w*h, w2=im2.w, n2=w2*im2.h;
+    const int dTile = d+x1-x2; // Disparity between tiles
+    const int colorMax=cost.colorMax, gradMax=cost.gradMax;
+    const int wColor=cost.weightColor, wGrad=cost.weightGrad;
+    const int shift=cost.shift, round=(1<<shift)>>1;
+    const short maxCost =
+        static_cast<short>((wColor*colorMax+wGrad*gradMax+round) >> shift);
+    // Columns matched inside im2
+    const int xMin = std::min(w, std::max(0, -x1-d));
+    const int xMax = std::max(xMin, std::min(w, fullWidth-x1-d));
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++) {
+        short* out = &cost.cost[y*w];
+        std::fill(out, out+xMin, maxCost);
+        std::fill(out+xMax, out+w, maxCost);
+        const unsigned char* R1 = &im1.rgb[y*w];
+        const unsigned char* R2 = &im2.rgb[y*w2];
+        const short* D1 = &im1.gradient[y*w];
+        const short* D2 = &im2.gradient[y*w2];
+        for(int x=xMin; x<xMax; x++) {
+            const int x2=x+dTile;
+            int costColor = std::abs(R1[x]-R2[x2]) +
+                            std::abs(R1[n1+x]-R2[n2+x2]) +
+                            std::abs(R1[2*n1+x]-R2[2*n2+x2]);
+            costColor = std::min(32*costColor, colorMax);
+            const int costGrad = std::min(3*std::abs(D1[x]-D2[x2]), gradMax);
+            out[x] = static_cast<short>
+                ((wColor*costColor + wGrad*costGrad + round) >> shift);
+        }
+    }
+}
+
+/// Mean of cost and covariance of cost with each channel of guide, eq. (14).
+///
+/// The sums in patches are exact, and so is the numerator of the covariance,
+/// n*sum(I*p)-sum(I)*sum(p), computed with 64-bit integers.
+/// The images \a meanCost and \a covar are allocated only if they do not have
+/// the size of the guide, the sums use the buffers of \a p.
+void fixed_moments(FixedCost& p, const FixedGuide& guide,
+                   Image& meanCost, Image covar[3]) {
+    const int w=guide.w, h=guide.h, n=w*h;
+    const std::vector<int>& nx=guide.nx;
+    const std::vector<int>& ny=guide.ny;
+    TrackedVector<int> &sumCost=p.sumCost, &prod=p.prod, &sumProd=p.sumProd;
+    box_sum(&p.cost[0], w, h, guide.radius, &sumCost[0], &p.rows[0],&p.col[0]);
+    if(meanCost.width()!=w || meanCost.height()!=h)
+        meanCost = Image(w,h);
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            meanCost(x,y) = sumCost[y*w+x] * (p.unit/(nx[x]*ny[y]));
+
+    const float unit = guide.unit*p.unit;
+    for(int c=0; c<guide.channels; c++) {
+        const unsigned short* I = &guide.planes[c*n];
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+        for(int i=0; i<n; i++)
+            prod[i] = I[i]*p.cost[i];
+        box_sum(&prod[0], w, h, guide.radius, &sumProd[0],
+                &p.rows[0], &p.col[0]);
+        const int* sumI = &guide.sums[c*n];
+        if(covar[c].width()!=w || covar[c].height()!=h)
+            covar[c] = Image(w,h);
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++) {
+                const int i=y*w+x;
+                const long long m = nx[x]*ny[y];
+                const long long num = m*sumProd[i] -
+                    static_cast<long long>(sumI[i])*sumCost[i];
+                covar[c](x,y) = static_cast<float>(num) * (unit/(m*m));
+            }
+    }
+}
@@ -0,0 +1,68 @@
+/**
+ * @file fixedPoint.h
+ * @brief Matching costs and their moments in integer arithmetic
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FIXEDPOINT_H
+#define FIXEDPOINT_H
+
+#include "image.h"
+#include <vector>
+struct ParamGuidedFilter;
+
+/// Color image with 8-bit channels and x-derivative of its gray level in
+/// fixed point.
+struct FixedImage {
+    int w, h;
+    TrackedVector<unsigned char> rgb; ///< 3 planes, values rounded
+    TrackedVector<short> gradient; ///< x-derivative of gray level, unit 1/32
+    FixedImage(Image color, Image gradient);
+    static long long memory(int w, int h);
+};
+
+/// Guide of the filter (color channels or gray level) with its sums in
+/// patches of radius \a radius.
+struct FixedGuide {
+    int w, h, channels, radius;
+    int maxValue; ///< Upper bound of values in planes
+    float unit; ///< Value of 1 in planes
+    TrackedVector<unsigned short> planes;
+    TrackedVector<int> sums; ///< Sum in patch for each plane
+    std::vector<int> nx, ny; ///< Sizes of patches along x and y
+    FixedGuide(Image guide, int channels, int radius);
+    static long long memory(int w, int h, int channels);
+};
+
+/// Matching costs of a disparity, 16-bit integers of value \a unit.
+///
+/// The unit is chosen so that all sums of products guide*cost in a patch fit
+/// in 32-bit integers.
+struct FixedCost {
+    int colorMax, gradMax; ///< Thresholds tau1 and tau2, unit 1/96
+    int weightColor, weightGrad; ///< 1-alpha and alpha, unit 1/4096
+    int shift; ///< Right shift of weighted sum
+    float unit;
+    TrackedVector<short> cost;
+    TrackedVector<int> sumCost, prod, sumProd, rows, col; ///< For fixed_moments
+    FixedCost(const FixedGuide& guide, const ParamGuidedFilter& param);
+    static long long memory(int w, int h);
+};
+
+void fixed_cost(const FixedImage& im1, const FixedImage& im2,
+                int d, int x1, int x2, int fullWidth, FixedCost& cost);
+void fixed_moments(FixedCost& p, const FixedGuide& guide,
+                   Image& meanCost, Image covar[3]);
+
+#endif
@@ -0,0 +1,405 @@
+/**
+ * @file guidance.cpp
+ * @brief Data depending only on the guidance image, with cache
+ * @author Pauline Tan <pauline.tan@ens-cachan.fr>
+ *         Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pauline Tan, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "guidance.h"
+#include "io_png.h"
+#include "mutex.h"
+#include "profile.h"
+#include <list>
+#include <vector>
+#include <cstring>
+
+/// Inverse of symmetric 3x3 matrix
+static void inverseSym3(const float* matrix, float* inverse) {
+    inverse[0] = matrix[4]*matrix[8] - matrix[5]*matrix[7];
+    inverse[1] = matrix[2]*matrix[7] - matrix[1]*matrix[8];
+    inverse[2] = matrix[1]*matrix[5] - matrix[2]*matrix[4];
+    float det = matrix[0]*inverse[0]+matrix[3]*inverse[1]+matrix[6]*inverse[2];
+    det = 1/det;
+    inverse[0] *= det;
+    inverse[1] *= det;
+    inverse[2] *= det;
+    inverse[3] = inverse[1];
+    inverse[4] = (matrix[0]*matrix[8] - matrix[2]*matrix[6]) * det;
+    inverse[5] = (matrix[2]*matrix[3] - matrix[0]*matrix[5]) * det;
+    inverse[6] = inverse[2];
+    inverse[7] = inverse[5];
+    inverse[8] = (matrix[0]*matrix[4] - matrix[1]*matrix[3]) * det;
+}
+
+/// Allocate images used for the number of channels
+GuideStats::GuideStats(int w, int h, int c)
+: channels(c), meanR(w,h), invRR(w,h) {
+    if(channels == 3) {
+        meanG=Image(w,h); meanB=Image(w,h);
+        invRG=Image(w,h); invRB=Image(w,h);
+        invGG=Image(w,h); invGB=Image(w,h); invBB=Image(w,h);
+    }
+}
+
+/// Bytes of the images of statistics of size \a w x \a h with \a c channels,
+/// those allocated by the constructor.
+long long GuideStats::memory(int w, int h, int c) {
+    return (c==3? 9: 2)*Image::memory(w,h);
+}
+
+/// Statistics restricted to a rectangle.
+GuideStats GuideStats::crop(int x0, int y0, int w, int h) const {
+    GuideStats s(*this); // Shallow copy, all images replaced below
+    s.meanR = meanR.crop(x0,y0,w,h);
+    s.invRR = invRR.crop(x0,y0,w,h);
+    if(channels == 1)
+        return s;
+    s.meanG = meanG.crop(x0,y0,w,h);
+    s.meanB = meanB.crop(x0,y0,w,h);
+    s.invRG = invRG.crop(x0,y0,w,h);
+    s.invRB = invRB.crop(x0,y0,w,h);
+    s.invGG = invGG.crop(x0,y0,w,h);
+    s.invGB = invGB.crop(x0,y0,w,h);
+    s.invBB = invBB.crop(x0,y0,w,h);
+    return s;
+}
+
+/// Gray level and x-derivative of \a color, no cache.
+static ImageFeatures compute_features(Image color) {
+    Image R=color.r(), G=color.g(), B=color.b();
+    const int w=R.width(), h=R.height();
+    Image gray(w,h);
+    rgb_to_gray(&R(0,0), &G(0,0), &B(0,0), w, h, &gray(0,0));
+    return ImageFeatures(gray, gray.gradX());
+}
+
+/// Bytes of the features of an image of size \a w x \a h, see
+/// compute_features.
+long long ImageFeatures::memory(int w, int h) {
+    return 2*Image::memory(w,h);
+}
+
+/// Guidance statistics of \a color in patches of radius \a r, no cache, for
+/// each value of \a epsilon. The means are shared by all results.
+static std::vector<GuideStats> compute_stats(Image color, int r,
+                                             const std::vector<float>& eps) {
+    Image R=color.r(), G=color.g(), B=color.b();
+    const int w=R.width(), h=R.height();
+
+    // Compute the mean and variance of each patch, eq. (14), box filters
+    // being batched by 3 images
+    const Image* channels[3] = {&R, &G, &B};
+    Image mean[3];
+    Image::boxFilter(channels, 3, r, mean);
+
+    const int pairs[6][2] = {{0,0},{0,1},{0,2},{1,1},{1,2},{2,2}};
+    Image var[6]; // RR, RG, RB, GG, GB, BB
+    for(int k=0; k<6; k+=3) {
+        Image prod[3];
+        const Image* in[3];
+        for(int i=0; i<3; i++) {
+            prod[i] = (*channels[pairs[k+i][0]])*(*channels[pairs[k+i][1]]);
+            in[i] = &prod[i];
+        }
+        Image::boxFilter(in, 3, r, var+k);
+        for(int i=k; i<k+3; i++)
+            var[i] = var[i] - mean[pairs[i][0]]*mean[pairs[i][1]];
+    }
+    Image varRR=var[0], varRG=var[1], varRB=var[2];
+    Image varGG=var[3], varGB=var[4], varBB=var[5];
+
+    std::vector<GuideStats> stats;
+    for(size_t i=0; i<eps.size(); i++) {
+        GuideStats s(0,0);
+        s.meanR = mean[0];
+        s.meanG = mean[1];
+        s.meanB = mean[2];
+        s.invRR=Image(w,h); s.invRG=Image(w,h); s.invRB=Image(w,h);
+        s.invGG=Image(w,h); s.invGB=Image(w,h); s.invBB=Image(w,h);
+        const float epsilon = eps[i];
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++) {
+                // Computation of (Sigma_k+\epsilon Id)^{-1}
+                float S1[3*3] = { // Eq. (21)
+                    varRR(x,y)+epsilon, varRG(x,y), varRB(x,y),
+                    varRG(x,y), varGG(x,y)+epsilon, varGB(x,y),
+                    varRB(x,y), varGB(x,y), varBB(x,y)+epsilon };
+                float S2[3*3];
+                inverseSym3(S1, S2);
+                s.invRR(x,y) = S2[0];
+                s.invRG(x,y) = S2[1];
+                s.invRB(x,y) = S2[2];
+                s.invGG(x,y) = S2[4];
+                s.invGB(x,y) = S2[5];
+                s.invBB(x,y) = S2[8];
+            }
+        stats.push_back(s);
+    }
+    return stats;
+}
+
+/// Guidance statistics of \a gray in patches of radius \a r, no cache, for
+/// each value of \a epsilon. The means are shared by all results.
+static std::vector<GuideStats>
+compute_stats_gray(Image gray, int r, const std::vector<float>& eps) {
+    const int w=gray.width(), h=gray.height();
+    Image sq = gray*gray; // Mean and variance, eq. (14), in one batch
+    const Image* in[2] = {&gray, &sq};
+    Image mean[2];
+    Image::boxFilter(in, 2, r, mean);
+    Image var = mean[1] - mean[0]*mean[0];
+    std::vector<GuideStats> stats;
+    for(size_t i=0; i<eps.size(); i++) {
+        GuideStats s(0,0,1);
+        s.meanR = mean[0];
+        s.invRR = Image(w,h);
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+                s.invRR(x,y) = 1/(var(x,y)+eps[i]);
+        stats.push_back(s);
+    }
+    return stats;
+}
+
+/// Guidance statistics of \a im (with \a channels) in patches of radius \a r,
+/// no cache.
+static GuideStats compute_stats(Image im, int r, float epsilon, int channels) {
+    const std::vector<float> eps(1, epsilon);
+    return (channels==1)? compute_stats_gray(im, r, eps).front():
+                          compute_stats(im, r, eps).front();
+}
+
+/// Hash of pixel values of image with \a channels (FNV-1a on 32-bit words).
+static unsigned long long hash_pixels(Image im, int channels) {
+    const size_t n = static_cast<size_t>(channels)*im.width()*im.height();
+    const float* p = &im(0,0);
+    unsigned long long hash = 14695981039346656037ULL;
+    for(size_t i=0; i<n; i++) {
+        unsigned int v;
+        std::memcpy(&v, p+i, sizeof(v));
+        hash = (hash ^ v) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/// Key identifying an entry in the cache. For features, \a radius is -1.
+///
+/// The hash only speeds up the search: keys with same hash also compare their
+/// pixels, so that a collision cannot return the data of another image.
+struct CacheKey {
+    unsigned long long hash;
+    int w, h, channels;
+    int radius;
+    float epsilon;
+    Image pixels; ///< Shared with the caller, deep copy once in the cache
+    CacheKey(Image im, int c, int r, float eps)
+    : hash(hash_pixels(im,c)), w(im.width()), h(im.height()), channels(c),
+      radius(r), epsilon(eps), pixels(im) {}
+    /// Same key owning a copy of the pixels, to be stored in the cache.
+    CacheKey stored() const {
+        CacheKey k = *this;
+        k.pixels = pixels.crop(0, 0, w, h, channels);
+        return k;
+    }
+    bool operator==(const CacheKey& k) const {
+        return (hash==k.hash && w==k.w && h==k.h && channels==k.channels &&
+                radius==k.radius && epsilon==k.epsilon &&
+                std::memcmp(&const_cast<Image&>(pixels)(0,0),
+                            &const_cast<Image&>(k.pixels)(0,0),
+                            sizeof(float)*channels*w*h) == 0);
+    }
+};
+
+/// Cache, least recently used entries are at the end of the lists.
+static std::list< std::pair<CacheKey,ImageFeatures> > cacheFeatures;
+static std::list< std::pair<CacheKey,GuideStats> > cacheStats;
+static size_t cacheSize = 2; ///< Max number of entries in each list
+
+/// Mutual exclusion for access to the cache from concurrent threads.
+static Mutex cacheMutex;
+
+/// Look for \a key in \a cache, putting it in front if found.
+template <class T>
+static bool find(std::list< std::pair<CacheKey,T> >& cache,const CacheKey& key){
+    typename std::list< std::pair<CacheKey,T> >::iterator it=cache.begin();
+    for(; it!=cache.end(); ++it)
+        if(it->first == key) {
+            cache.splice(cache.begin(), cache, it);
+            return true;
+        }
+    return false;
+}
+
+/// Insert in front of \a cache and discard least recently used entries.
+template <class T>
+static void insert(std::list< std::pair<CacheKey,T> >& cache,
+                   const CacheKey& key, const T& value) {
+    if(cacheSize == 0)
+        return;
+    cache.push_front(std::make_pair(key.stored(),value));
+    while(cache.size() > cacheSize)
+        cache.pop_back();
+}
+
+/// Gray level and x-derivative of a color image.
+///
+/// The result is taken from the cache when an image with same pixel values
+/// was already processed.
+ImageFeatures image_features(Image color) {
+    CacheKey key(color, 3, -1, 0);
+    {
+        MutexLock lock(cacheMutex);
+        if(find(cacheFeatures, key))
+            return cacheFeatures.front().second;
+    }
+    ProfileTimer timer("features");
+    ImageFeatures f = compute_features(color);
+    timer.stop();
+    MutexLock lock(cacheMutex);
+    insert(cacheFeatures, key, f);
+    return f;
+}
+
+/// Statistics of a guidance image in patches of radius \a r.
+///
+/// The guide is a color image if \a channels is 3, a gray image if it is 1.
+/// The result is taken from the cache when an image with same pixel values
+/// was already processed with same \a radius and \a epsilon.
+GuideStats guide_statistics(Image guide, int radius, float epsilon,
+                            int channels) {
+    CacheKey key(guide, channels, radius, epsilon);
+    {
+        MutexLock lock(cacheMutex);
+        if(find(cacheStats, key))
+            return cacheStats.front().second;
+    }
+    ProfileTimer timer("guide_statistics");
+    GuideStats s = compute_stats(guide, radius, epsilon, channels);
+    timer.stop();
+    MutexLock lock(cacheMutex);
+    insert(cacheStats, key, s);
+    return s;
+}
+
+/// Statistics of a guidance image in patches of radius \a radius, for each
+/// value of \a epsilon, without cache.
+///
+/// The means and covariances in patches are computed once, only the inverses
+/// of regularized covariances depending on epsilon. The means are shared by
+/// the results.
+std::vector<GuideStats> guide_statistics(Image guide, int radius,
+                                         const std::vector<float>& epsilon,
+                                         int channels) {
+    ProfileTimer timer("guide_statistics");
+    return (channels==1)? compute_stats_gray(guide, radius, epsilon):
+                          compute_stats(guide, radius, epsilon);
+}
+
+/// Set the max number of images whose features (and separately statistics)
+/// are kept in the cache. A value of 0 deactivates the cache.
+void set_guidance_cache_size(int n) {
+    MutexLock lock(cacheMutex);
+    cacheSize = (n>0)? static_cast<size_t>(n): 0;
+    while(cacheFeatures.size() > cacheSize)
+        cacheFeatures.pop_back();
+    while(cacheStats.size() > cacheSize)
+        cacheStats.pop_back();
+}
+
+/// Data of a view of a StereoPairContext, with flags of items computed.
+struct ViewData {
+    Mutex mutex; ///< Held during computation of an item
+    Image color;
+    bool hasFeatures, hasStats;
+    ImageFeatures features;
+    GuideStats stats;
+    int channels, subsample, radius; ///< Parameters of stats
+    float epsilon;
+    Image median;
+    explicit ViewData(Image im)
+    : color(im), hasFeatures(false), hasStats(false),
+      features(Image(),Image()), stats(0,0,1),
+      channels(0), subsample(0), radius(0), epsilon(0) {}
+};
+
+/// Context of images \a im1 and \a im2, nothing is computed yet.
+StereoPairContext::StereoPairContext(Image im1, Image im2, bool cache)
+: useCache(cache) {
+    views[0] = new ViewData(im1);
+    views[1] = new ViewData(im2);
+}
+
+StereoPairContext::~StereoPairContext() {
+    delete views[0];
+    delete views[1];
+}
+
+/// Color image of \a view.
+Image StereoPairContext::image(int view) const {
+    return views[view]->color;
+}
+
+/// Gray level and x-derivative of image of \a view.
+ImageFeatures StereoPairContext::features(int view) {
+    ViewData& v = *views[view];
+    MutexLock lock(v.mutex);
+    if(! v.hasFeatures) {
+        if(useCache)
+            v.features = image_features(v.color);
+        else {
+            ProfileTimer timer("features");
+            v.features = compute_features(v.color);
+        }
+        v.hasFeatures = true;
+    }
+    return v.features;
+}
+
+/// Statistics of image of \a view as guide, in color (\a channels=3) or gray
+/// level (\a channels=1), subsampled by factor \a subsample, in patches of
+/// \a radius (at subsampled resolution). See guide_statistics.
+GuideStats StereoPairContext::guide(int view, int channels, int subsample,
+                                    int radius, float epsilon) {
+    Image im = (channels==1)? features(view).gray: image(view);
+    ViewData& v = *views[view];
+    MutexLock lock(v.mutex);
+    if(! v.hasStats || v.channels!=channels || v.subsample!=subsample ||
+       v.radius!=radius || v.epsilon!=epsilon) {
+        v.stats = GuideStats(0,0,1); // Release previous ones before computing
+        if(subsample > 1)
+            im = im.downsample(subsample, channels);
+        if(useCache)
+            v.stats = guide_statistics(im, radius, epsilon, channels);
+        else {
+            ProfileTimer timer("guide_statistics");
+            v.stats = compute_stats(im, radius, epsilon, channels);
+        }
+        v.hasStats = true;
+        v.channels = channels;
+        v.subsample = subsample;
+        v.radius = radius;
+        v.epsilon = epsilon;
+    }
+    return v.stats;
+}
+
+/// Image of \a view filtered by median of radius 1 in each channel, the guide
+/// of the weighted median filter of densification.
+Image StereoPairContext::medianColor(int view) {
+    ViewData& v = *views[view];
+    MutexLock lock(v.mutex);
+    if(v.median.width() == 0)
+        v.median = v.color.medianColor(1);
+    return v.median;
+}
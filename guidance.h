@@ -0,0 +1,82 @@
+/**
+ * @file guidance.h
+ * @brief Data depending only on the guidance image, with cache
+ * @author Pauline Tan <pauline.tan@ens-cachan.fr>
+ *         Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pauline Tan, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GUIDANCE_H
+#define GUIDANCE_H
+
+#include "image.h"
+
+/// Data depending only on a color image: gray level and its x-derivative.
+struct ImageFeatures {
+    Image gray;
+    Image gradient;
+    ImageFeatures(Image g, Image grad): gray(g), gradient(grad) {}
+    static long long memory(int width, int height);
+};
+
+/// Statistics of the guidance image in patches of given radius: means of
+/// channels, eq. (14), and inverse of regularized covariance, eq. (21).
+///
+/// The inverse is symmetric, so only 6 coefficients are stored. For a gray
+/// guide (1 channel), only meanR and invRR (inverse of regularized variance)
+/// are used, the other images are empty.
+struct GuideStats {
+    int channels; ///< 3 for color guide, 1 for gray guide
+    Image meanR, meanG, meanB;
+    Image invRR, invRG, invRB, invGG, invGB, invBB;
+    GuideStats(int width, int height, int channels=3);
+    GuideStats crop(int x0, int y0, int width, int height) const;
+    static long long memory(int width, int height, int channels);
+};
+
+struct ViewData;
+
+/// Data of a stereo pair shared by the disparity maps of both views (0 for
+/// im1, 1 for im2) and the post-processing: the images, their features, the
+/// statistics of each view as guide and its median filtered version.
+///
+/// Each item is computed at its first request and kept, concurrent requests
+/// from other threads waiting for it. The statistics are kept for the last
+/// parameters only. With \a cache, features and statistics also go through the
+/// cache of image_features and guide_statistics, worth it when the same
+/// images come again (server mode), but at the cost of hashing the images.
+class StereoPairContext {
+public:
+    StereoPairContext(Image im1, Image im2, bool cache=false);
+    ~StereoPairContext();
+    Image image(int view) const;
+    ImageFeatures features(int view);
+    GuideStats guide(int view, int channels, int subsample, int radius,
+                     float epsilon);
+    Image medianColor(int view);
+private:
+    bool useCache;
+    ViewData* views[2];
+    StereoPairContext(const StereoPairContext&); ///< Not copyable
+    StereoPairContext& operator=(const StereoPairContext&);
+};
+
+ImageFeatures image_features(Image color);
+GuideStats guide_statistics(Image guide, int radius, float epsilon,
+                            int channels=3);
+std::vector<GuideStats> guide_statistics(Image guide, int radius,
+                                         const std::vector<float>& epsilon,
+                                         int channels=3);
+void set_guidance_cache_size(int n);
+
+#endif
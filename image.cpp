@@ -19,10 +19,148 @@
 #include "io_png.h"
 #include <algorithm>
 #include <cassert>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/// Atomic increment of reference counter, return new value.
+///
+/// Images can be shared between threads, for example through the cache of
+/// guidance data.
+static int increment(int* count) {
+#ifdef _MSC_VER
+    return _InterlockedIncrement(reinterpret_cast<long volatile*>(count));
+#else
+    return __sync_add_and_fetch(count, 1);
+#endif
+}
+
+/// Atomic decrement of reference counter, return new value.
+static int decrement(int* count) {
+#ifdef _MSC_VER
+    return _InterlockedDecrement(reinterpret_cast<long volatile*>(count));
+#else
+    return __sync_sub_and_fetch(count, 1);
+#endif
+}
+
+/// Bytes of images and tracked vectors currently allocated, and max since
+/// last reset
+static long long liveBytes=0, peakBytes=0;
+
+/// Atomic addition to \a value, return new value.
+static long long add(long long* value, long long n) {
+#ifdef _MSC_VER
+    return _InterlockedExchangeAdd64(value, n) + n;
+#else
+    return __sync_add_and_fetch(value, n);
+#endif
+}
+
+/// Atomically replace \a value by \a v if it is \a old, return old value.
+static long long compare_swap(long long* value, long long old, long long v) {
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange64(value, v, old);
+#else
+    return __sync_val_compare_and_swap(value, old, v);
+#endif
+}
+
+/// Atomically replace \a value by \a v if it is \a old, return old value.
+static int compare_swap(int* value, int old, int v) {
+#ifdef _MSC_VER
+    return _InterlockedCompareExchange(reinterpret_cast<long volatile*>(value),
+                                       v, old);
+#else
+    return __sync_val_compare_and_swap(value, old, v);
+#endif
+}
+
+/// Atomically set \a peak to \a v if it is larger.
+static void raise_peak(long long* peak, long long v) {
+    long long p = add(peak, 0);
+    while(v > p) {
+        const long long old = compare_swap(peak, p, v);
+        if(old == p)
+            break;
+        p = old;
+    }
+}
+
+/// Peaks of bytes since the start of watches, for the intervals of time of
+/// concurrent stages. A slot is in use if its flag is 1.
+static const int WATCHES=64;
+static int watchUsed[WATCHES];
+static long long watchPeak[WATCHES];
+
+/// Record allocation (\a n>0) or deallocation (\a n<0) of \a n bytes.
+void image_memory_track(long long n) {
+    const long long live = add(&liveBytes, n);
+    raise_peak(&peakBytes, live);
+    if(n > 0)
+        for(int i=0; i<WATCHES; i++)
+            if(watchUsed[i])
+                raise_peak(&watchPeak[i], live);
+}
+
+/// Start watching the peak of memory, return the watch (-1 if too many are
+/// in use) to give to image_memory_unwatch.
+int image_memory_watch() {
+    for(int i=0; i<WATCHES; i++)
+        if(compare_swap(&watchUsed[i], 0, 1) == 0) {
+            long long peak = add(&watchPeak[i], 0), old;
+            while((old=compare_swap(&watchPeak[i], peak, 0)) != peak)
+                peak = old;
+            raise_peak(&watchPeak[i], image_memory_live());
+            return i;
+        }
+    return -1;
+}
+
+/// Stop \a watch, return the max bytes allocated at the same time since its
+/// start (the global peak if \a watch is -1).
+long long image_memory_unwatch(int watch) {
+    if(watch < 0)
+        return image_memory_peak();
+    const long long peak = add(&watchPeak[watch], 0);
+    compare_swap(&watchUsed[watch], 1, 0);
+    return peak;
+}
+
+/// Bytes of pixels of images and tracked vectors currently allocated.
+long long image_memory_live() {
+    return add(&liveBytes, 0);
+}
+
+/// Max bytes of images and tracked vectors allocated at the same time since
+/// the last call to image_memory_reset_peak.
+long long image_memory_peak() {
+    return add(&peakBytes, 0);
+}
+
+/// Set the peak memory to the current one.
+void image_memory_reset_peak() {
+    long long peak = image_memory_peak();
+    long long old;
+    while((old=compare_swap(&peakBytes, peak, image_memory_live())) != peak)
+        peak = old;
+}
 
 /// Constructor
+///
+/// The counter block holds the reference count and the number of pixels, which
+/// can differ from the final w*h for multi-channel images.
 Image::Image(int width, int height)
-: count(new int(1)), tab(new float[width*height]), w(width), h(height) {}
+: count(new int[2]), tab(new float[width*height]), w(width), h(height) {
+    count[0] = 1;
+    count[1] = width*height;
+    image_memory_track(memory(width,height));
+}
+
+/// Bytes counted for an image of size \a width x \a height.
+long long Image::memory(int width, int height) {
+    return static_cast<long long>(sizeof(float))*width*height;
+}
 
 /// Constructor with array of pixels.
 ///
@@ -34,7 +172,7 @@ Image::Image(float* pix, int width, int height)
 Image::Image(const Image& I)
   : count(I.count), tab(I.tab), w(I.w), h(I.h) {
     if(count)
-        ++*count;
+        increment(count);
 }
 
 /// Assignment operator (shallow copy)
@@ -42,7 +180,7 @@ Image& Image::operator=(const Image& I) {
     if(count != I.count) {
         kill();
         if(I.count)
-            ++*I.count;
+            increment(I.count);
     }
     count=I.count; tab=I.tab; w=I.w; h=I.h;
     return *this;
@@ -55,10 +193,27 @@ Image Image::clone() const {
     return I;
 }
 
+/// Deep copy of rectangle of origin (\a x0,\a y0) and given dimensions.
+///
+/// For a color image, \a channels should be 3.
+Image Image::crop(int x0, int y0, int width, int height, int channels) const {
+    assert(0<=x0 && x0+width<=w && 0<=y0 && y0+height<=h);
+    Image C(width, channels*height);
+    C.h = height;
+    float* out=C.tab;
+    for(int c=0; c<channels; c++)
+        for(int y=y0; y<y0+height; y++, out+=width) {
+            const float* in=tab+(c*h+y)*w+x0;
+            std::copy(in, in+width, out);
+        }
+    return C;
+}
+
 /// Free memory
 void Image::kill() {
-    if(count && --*count == 0) {
-        delete count;
+    if(count && decrement(count) == 0) {
+        image_memory_track(-static_cast<long long>(sizeof(float))*count[1]);
+        delete [] count;
         delete [] tab;
     }
 }
@@ -18,7 +18,48 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <memory>
 #include <vector>
+class Progress;
+
+void image_memory_track(long long bytes);
+
+/// Standard allocator counting its memory with the one of images, so that
+/// image_memory_peak accounts for buffers that are not of class Image.
+template <typename T>
+class TrackedAllocator : public std::allocator<T> {
+public:
+    typedef typename std::allocator<T>::size_type size_type;
+    template <typename U> struct rebind { typedef TrackedAllocator<U> other; };
+    TrackedAllocator() {}
+    TrackedAllocator(const TrackedAllocator& a): std::allocator<T>(a) {}
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U>& a): std::allocator<T>(a) {}
+    T* allocate(size_type n, const void* = 0) {
+        T* p = std::allocator<T>::allocate(n);
+        image_memory_track(static_cast<long long>(n*sizeof(T)));
+        return p;
+    }
+    void deallocate(T* p, size_type n) {
+        image_memory_track(-static_cast<long long>(n*sizeof(T)));
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+/// Vector whose memory is counted with the one of images. For large buffers
+/// of the computation.
+template <typename T>
+class TrackedVector : public std::vector< T, TrackedAllocator<T> > {
+    typedef std::vector< T, TrackedAllocator<T> > Base;
+public:
+    TrackedVector() {}
+    explicit TrackedVector(typename Base::size_type n, const T& v=T())
+    : Base(n, v) {}
+    /// Bytes counted for a vector of \a n elements.
+    static long long memory(long long n) {
+        return n*static_cast<long long>(sizeof(T));
+    }
+};
 
 /// Float image class, with shallow copy for performance.
 ///
@@ -33,12 +74,15 @@ class Image {
     int w, h;
     void kill();
 public:
+    Image(): count(0), tab(0), w(0), h(0) {}
     Image(int width, int height);
     Image(float* pix, int width, int height);
     Image(const Image& I);
     ~Image() { kill(); }
     Image& operator=(const Image& I);
     Image clone() const;
+    Image crop(int x0, int y0, int width, int height, int channels=1) const;
+    static long long memory(int width, int height);
 
     int width() const { return w; }
     int height() const { return h; }
@@ -59,12 +103,22 @@ public:
     void fillMinX(float vMin);
     void fillMaxX(float vMin);
     Image boxFilter(int radius) const;
+    static void boxFilter(const Image* const* in, int n, int radius,
+                          Image* out);
+    static void boxFilter(const Image* const* in, int n, int radius,
+                          Image* out, TrackedVector<double>& S);
+    Image downsample(int factor, int channels=1) const;
+    void downsample(int factor, Image& D) const;
+    Image upsample(int factor, int width, int height) const;
+    void upsample(int factor, Image& U,
+                  std::vector<int>& x0, std::vector<float>& fx) const;
     void median(int radius, Image& M) const;
     Image medianColor(int radius) const;
     Image weightedMedianColor(const Image& guidance,
                               const Image& where, int vMin, int vMax,
                               int radius,
-                              float sigmaSpace, float sigmaColor) const;
+                              float sigmaSpace, float sigmaColor,
+                              Progress* progress=0) const;
 private:
     void fillX(float vMin, const float& (*cmp)(const float&,const float&));
     float dist2Color(int x1,int y1, int x2,int y2) const;
@@ -73,6 +127,19 @@ private:
                         float sSpace, float sColor) const;
 };
 
+/// Whether loops over the rows of an image of \a w x \a h pixels are run in
+/// parallel (OpenMP, with the number of threads of the enclosing task). For
+/// small images, the threads would cost more than they save.
+inline bool parallel_rows(int w, int h) {
+    return w*h >= 1<<15;
+}
+
+long long image_memory_live();
+int image_memory_watch();
+long long image_memory_unwatch(int watch);
+long long image_memory_peak();
+void image_memory_reset_peak();
+
 bool save_disparity(const char* file_name, const Image& disparity,
                     int dMin, int dMax, int grayMin, int grayMax);
 
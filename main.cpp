@@ -17,21 +17,75 @@
  */
 
 #include "costVolume.h"
+#include "guidance.h"
 #include "occlusion.h"
+#include "patchMatch.h"
+#include "server.h"
+#include "profile.h"
+#include "progress.h"
 #include "image.h"
 #include "cmdLine.h"
 #include "io_png.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /// Names of output image files
 static const char* OUTFILE1="disparity.png";
 static const char* OUTFILE2="disparity_occlusion.png";
 static const char* OUTFILE3="disparity_occlusion_filled.png";
 static const char* OUTFILE4="disparity_occlusion_filled_smoothed.png";
+static const char* OUTFILE5="confidence.png";
+
+/// Name of file in sequence: \a pattern with printf-like format of \a frame.
+///
+/// If \a frame is negative, \a pattern is returned unchanged.
+static std::string frame_name(const char* pattern, int frame) {
+    if(frame < 0)
+        return pattern;
+    std::vector<char> name(std::string(pattern).size()+32);
+    snprintf(&name[0], name.size(), pattern, frame);
+    return &name[0];
+}
+
+/// Name of output file: \a name with \a frame number inserted before
+/// extension. If \a frame is negative, \a name is returned unchanged.
+static std::string output_name(const char* name, int frame) {
+    if(frame < 0)
+        return name;
+    std::string s(name);
+    std::ostringstream str;
+    str << s.substr(0,s.rfind('.')) << '_';
+    str.width(4); str.fill('0');
+    str << frame << s.substr(s.rfind('.'));
+    return str.str();
+}
+
+/// Save disparity map and signal error.
+static bool save(const char* name, int frame, const Image& disparity,
+                 int dMin, int dMax, int grayMin, int grayMax) {
+    std::string file = output_name(name, frame);
+    std::string stage = "write " + file;
+    ProfileTimer timer(stage.c_str());
+    if(! save_disparity(file.c_str(), disparity, dMin,dMax, grayMin,grayMax)) {
+        std::cerr << "Error writing file " << file << std::endl;
+        return false;
+    }
+    return true;
+}
 
 static void usage(const char* name) {
     ParamGuidedFilter p;
     ParamOcclusion q;
+    ParamWarmStart w;
+    ParamPatchMatch m;
     std::cerr <<"Stereo Disparity through Cost Aggregation with Guided Filter\n"
               << "Usage: " << name << " [options] im1.png im2.png dmin dmax\n\n"
               << "Options (default values in parentheses)\n"
@@ -43,10 +97,30 @@ static void usage(const char* name) {
               << "    -C tau1: max for color difference ("
               <<p.color_threshold<<")\n"
               << "    -G tau2: max for gradient difference ("
-              <<p.gradient_threshold << ")\n\n"
+              <<p.gradient_threshold << ")\n"
+              << "    -S factor: subsampling for fast guided filter ("
+              <<p.subsample << ")\n"
+              << "    --gray-guide: gray level guide instead of color\n"
+              << "    --compact: 16-bit costs and half float coefficients\n"
+              << "    --fixed: integer costs and sums in patches\n\n"
+              << "PatchMatch search (instead of cost volume):\n"
+              << "    --patchmatch n: number of iterations (0: cost volume)\n"
+              << "    --pm-stride s: step of pixels summed in patches ("
+              <<m.stride << ")\n"
+              << "    --pm-seed s: seed of random search ("<<m.seed << ")\n\n"
+              << "Parameter sweep (lists like 5,9,13; default: value above):\n"
+              << "    --sweep-R list, --sweep-E list, --sweep-A list,\n"
+              << "    --sweep-C list, --sweep-G list: lists of -R,-E,-A,-C,-G\n"
+              << "    --gt file: ground truth disparity map, for error\n\n"
+              << "Region of interest (disparity computed only there):\n"
+              << "    --roi x,y,w,h: rectangle of top-left corner (x,y)\n"
+              << "    --roi-mask file: image, non-zero pixels in region\n"
+              << "    --roi-crop: output maps of size of region\n\n"
               << "Occlusion detection:\n"
               << "    -o tolDiffDisp: tolerance for left-right disp. diff. ("
-              <<q.tol_disp << ")\n\n"
+              <<q.tol_disp << ")\n"
+              << "    --confidence t: occlusion if confidence below t, "
+              << "instead of left-right\n\n"
               << "Densification:\n"
               << "    -O sense: fill occlusion, sense='r':right, 'l':left\n"
               << "    -r radius: radius of the weighted median filter ("
@@ -56,10 +130,286 @@ static void usage(const char* name) {
               << "    -s sigmas: value of sigma_space ("
               <<q.sigma_space << ")\n\n"
               << "    -a grayMin: value of gray for min disparity (255)\n"
-              << "    -b grayMax: value of gray for max disparity (0)"
+              << "    -b grayMax: value of gray for max disparity (0)\n"
+              << "    --profile file: write time of each stage (JSON lines)\n"
+              << "    --estimate: print predicted peak memory and exit\n\n"
+              << "Sequence mode (im1, im2 are patterns like im1_%03d.png):\n"
+              << "    --frames n: number of frames of the sequence\n"
+              << "    --first i: index of first frame (0)\n"
+              << "    --refresh k: period of full disparity search (10)\n"
+              << "    --tile t: size of tiles with own disparity range ("
+              <<w.tile << ")\n"
+              << "    --dilation r: spatial dilation of previous disparity ("
+              <<w.dilation << ")\n"
+              << "    --tolerance t: margin around previous disparities ("
+              <<w.tolerance << ")\n\n"
+              << "Server mode:\n"
+              << "    --server socket: answer requests on UNIX socket, "
+              << "'-' for stdin\n"
+              << "    --cache n: number of guidance images kept in cache (2)\n"
+              << "Usage: " << name << " --server socket"
               << std::endl;
 }
 
+/// Predicate for values below a threshold
+struct below {
+    float v;
+    explicit below(float value): v(value) {}
+    bool operator()(float x) const { return x < v; }
+};
+
+/// Print predicted peak memory for images of size \a w x \a h.
+///
+/// With occlusion detection by left-right check, the two disparity maps are
+/// computed concurrently, so the peak is bounded by twice the one of a single
+/// map. With \a patchMatch, the disparity maps are searched by PatchMatch.
+/// The post-processing needs less memory than the pass. The memory already
+/// used by the process (code, libraries, input images and their decoding) is
+/// measured, so the sum predicts the maximum resident set size.
+static void print_memory_estimate(int w, int h, const ParamGuidedFilter& p,
+                                  bool detectOcc, bool confidence,
+                                  bool patchMatch) {
+    const long long pass = patchMatch? patch_match_memory(w, h, p):
+        filter_cost_volume_memory(w, h, p, confidence);
+    const long long process = profile_resident_memory();
+    const long long total = (detectOcc? 2: 1)*pass + process;
+    std::cout << "Estimated peak memory: " << ((total+(1<<20)-1)>>20) << " MB"
+              << " (process with input images " << process << " bytes, "
+              << (patchMatch? "PatchMatch ": "cost volume filtering ")
+              << (detectOcc? "2x": "") << pass << " bytes)" << std::endl;
+}
+
+/// Print throughput in megapixel-disparities per second of the stages
+/// measured by profiling, for images of \a n pixels.
+///
+/// The cost volume throughput counts only the disparities searched (counter
+/// "disparities", mean per pixel with warm start, whose tiles have their own
+/// ranges), of both maps with the left-right check, which are computed
+/// concurrently: the time is then the one of stage "left_right_maps". The
+/// weighted median always handles the full range of \a nDisp disparities.
+static void print_throughput(size_t n, int nDisp) {
+    const double mp = n*1e-6;
+    const double both = profile_wall("left_right_maps");
+    const double cost = (both > 0)? both: profile_wall("cost_volume");
+    const double median = profile_wall("weighted_median");
+    std::cout << "Throughput (MP.D/s):";
+    if(cost > 0)
+        std::cout << " cost volume " << mp*profile_counter("disparities")/cost;
+    if(median > 0)
+        std::cout << ", weighted median " << mp*nDisp/median;
+    std::cout << std::endl;
+}
+
+/// Progress of the cost volume shown as \a n stars on standard output.
+class Stars : public Progress {
+    int n, shown;
+protected:
+    bool update(const char*, float fraction) {
+        const int k = static_cast<int>(fraction*n+0.5f);
+        if(k > shown) {
+            std::cout << std::string(k-shown,'*') << std::flush;
+            shown = k;
+        }
+        return true;
+    }
+public:
+    explicit Stars(int steps): n(steps), shown(0) {}
+};
+
+/// Set the number of threads of parallel regions nested in the current one.
+static void set_thread_budget(int threads) {
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#else
+    (void)threads;
+#endif
+}
+
+/// Parse comma separated list of numbers \a str into \a values, unchanged if
+/// \a str is empty. Return false if an item is empty or not a number.
+template <typename T>
+static bool parse_list(const std::string& str, std::vector<T>& values) {
+    if(str.empty())
+        return true;
+    if(str[str.size()-1] == ',') // getline drops a trailing empty item
+        return false;
+    values.clear();
+    std::istringstream list(str);
+    std::string item;
+    while(std::getline(list, item, ',')) {
+        std::istringstream in(item);
+        T v;
+        if(! ((in >> v) && in.eof()))
+            return false;
+        values.push_back(v);
+    }
+    return ! values.empty();
+}
+
+/// Whether all values of \a v are in [\a min,\a max], or in ]\a min,\a max]
+/// if \a open.
+template <typename T>
+static bool in_range(const std::vector<T>& v, T min, T max, bool open=false) {
+    for(size_t i=0; i<v.size(); i++)
+        if(v[i]<min || v[i]>max || (open && v[i]==min))
+            return false;
+    return true;
+}
+
+/// Read ground truth disparity map \a file of size \a w x \a h, written like
+/// save_disparity with the same values, in \a gt. Occlusions (cyan) get NaN.
+/// Return false if the file cannot be read or has a different size.
+static bool load_ground_truth(const char* file, int w, int h,
+                              int dMin, int dMax, int grayMin, int grayMax,
+                              Image& gt) {
+    size_t w2, h2;
+    unsigned char* pix = io_png_read_u8_rgb(file, &w2, &h2);
+    if(! pix || (int)w2!=w || (int)h2!=h) {
+        free(pix);
+        return false;
+    }
+    const float a=(grayMax-grayMin)/float(dMax-dMin);
+    const float b=(grayMin*dMax-grayMax*dMin)/float(dMax-dMin);
+    const int n=w*h;
+    gt = Image(w,h);
+    for(int i=0; i<n; i++)
+        (&gt(0,0))[i] = (pix[i]==0 && pix[i+n]==255 && pix[i+2*n]==255)?
+            std::numeric_limits<float>::quiet_NaN(): (pix[i]-b)/a;
+    free(pix);
+    return true;
+}
+
+/// Percentage of pixels with error above 1 and mean absolute error of
+/// \a disparity compared to ground truth \a gt, NaN pixels being ignored.
+static void ground_truth_error(const Image& disparity, const Image& gt,
+                               float& bad, float& mae) {
+    size_t count=0, nBad=0;
+    double sum=0;
+    for(int y=0; y<gt.height(); y++)
+        for(int x=0; x<gt.width(); x++) {
+            if(gt(x,y) != gt(x,y)) // NaN
+                continue;
+            const float e = std::abs(disparity(x,y)-gt(x,y));
+            ++count;
+            sum += e;
+            if(e > 1)
+                ++nBad;
+        }
+    bad = count? 100.0f*nBad/count: 0;
+    mae = count? static_cast<float>(sum/count): 0;
+}
+
+/// Disparity maps of \a pair for each parameters \a params, written in files
+/// numbered like frames, with error against ground truth \a gtFile if not
+/// empty. Return false in case of error.
+static bool run_sweep(StereoPairContext& pair, int dMin, int dMax,
+                      const std::vector<ParamGuidedFilter>& params,
+                      const std::string& gtFile, int grayMin, int grayMax) {
+    const int n = static_cast<int>(params.size());
+    Image gt;
+    const Image im = pair.image(0);
+    if(! gtFile.empty() &&
+       ! load_ground_truth(gtFile.c_str(), im.width(), im.height(),
+                           dMin, dMax, grayMin, grayMax, gt)) {
+        std::cerr << "Cannot read ground truth " << gtFile << " of same size"
+                  << std::endl;
+        return false;
+    }
+    std::cout << "Sweep: " << n << " parameters, " << (dMax-dMin+1)
+              << " disparities. ";
+    Stars stars(dMax-dMin+1);
+    ProfileTimer timer("cost_volume");
+    std::vector<Image> disp = filter_cost_volume_sweep(pair, 0, dMin, dMax,
+                                                       params, &stars);
+    timer.stop();
+    std::cout << std::endl;
+    if(disp.empty()) { // Cancelled
+        std::cerr << "Sweep cancelled" << std::endl;
+        return false;
+    }
+    for(int i=0; i<n; i++) {
+        const ParamGuidedFilter& p = params[i];
+        if(! save(OUTFILE1, i, disp[i], dMin,dMax, grayMin,grayMax))
+            return false;
+        std::cout << output_name(OUTFILE1, i) << ": R=" << p.kernel_radius
+                  << " E=" << p.epsilon << " A=" << p.alpha
+                  << " C=" << p.color_threshold
+                  << " G=" << p.gradient_threshold;
+        if(gt.width() > 0) {
+            float bad, mae;
+            ground_truth_error(disp[i], gt, bad, mae);
+            std::cout << ", error>1: " << bad << "%, mean error: " << mae;
+        }
+        std::cout << std::endl;
+    }
+    return true;
+}
+
+/// Region of interest of images of size \a w x \a h in \a roi (x,y,w,h):
+/// rectangle \a rect "x,y,w,h" (whole image if empty) intersected with the
+/// bounding box of non-zero pixels of \a maskFile, if not empty, read in
+/// \a mask. Return false with a message if the region is invalid or empty.
+static bool region_of_interest(const std::string& rect,
+                               const std::string& maskFile, int w, int h,
+                               int roi[4], std::vector<unsigned char>& mask) {
+    std::vector<int> r;
+    if(! parse_list(rect, r) || (! rect.empty() && r.size()!=4)) {
+        std::cerr << "Error reading ROI " << rect << " (x,y,w,h)" << std::endl;
+        return false;
+    }
+    int x0=0, y0=0, x1=w, y1=h;
+    if(! r.empty()) {
+        x0 = std::max(x0, r[0]); x1 = std::min(x1, r[0]+r[2]);
+        y0 = std::max(y0, r[1]); y1 = std::min(y1, r[1]+r[3]);
+    }
+    if(! maskFile.empty()) {
+        size_t w2, h2;
+        unsigned char* pix = io_png_read_u8_gray(maskFile.c_str(), &w2, &h2);
+        if(! pix || (int)w2!=w || (int)h2!=h) {
+            free(pix);
+            std::cerr << "Cannot read ROI mask " << maskFile
+                      << " of same size" << std::endl;
+            return false;
+        }
+        mask.assign(pix, pix+w*h);
+        free(pix);
+        int mx0=w, my0=h, mx1=0, my1=0; // Bounding box of mask
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+                if(mask[y*w+x]) {
+                    mx0 = std::min(mx0,x); mx1 = std::max(mx1,x+1);
+                    my0 = std::min(my0,y); my1 = std::max(my1,y+1);
+                }
+        x0 = std::max(x0,mx0); x1 = std::min(x1,mx1);
+        y0 = std::max(y0,my0); y1 = std::min(y1,my1);
+    }
+    if(x0>=x1 || y0>=y1) {
+        std::cerr << "Error: empty region of interest" << std::endl;
+        return false;
+    }
+    roi[0]=x0; roi[1]=y0; roi[2]=x1-x0; roi[3]=y1-y0;
+    return true;
+}
+
+/// Map \a im of the region of interest \a roi in images of width \a w and
+/// height \a h, with value \a outside at pixels of zero \a mask, if not
+/// empty. If \a crop, the result has the size of the region, otherwise of
+/// the images with \a outside beyond the region.
+static Image roi_map(Image im, const int roi[4], int w, int h,
+                     const std::vector<unsigned char>& mask, float outside,
+                     bool crop) {
+    Image out = crop? im: Image(w,h);
+    if(! crop)
+        std::fill_n(&out(0,0), w*h, outside);
+    const int dx=crop? 0: roi[0], dy=crop? 0: roi[1];
+    for(int y=0; y<roi[3]; y++)
+        for(int x=0; x<roi[2]; x++) {
+            const bool in = mask.empty() || mask[(y+roi[1])*w+x+roi[0]];
+            out(x+dx,y+dy) = in? im(x,y): outside;
+        }
+    return out;
+}
+
 int main(int argc, char *argv[])
 {
     int grayMin=255, grayMax=0;
@@ -72,6 +422,31 @@ int main(int argc, char *argv[])
     cmd.add( make_option('E',paramGF.epsilon) );
     cmd.add( make_option('C',paramGF.color_threshold) );
     cmd.add( make_option('G',paramGF.gradient_threshold) );
+    cmd.add( make_option('S',paramGF.subsample) );
+    cmd.add( make_option(0,paramGF.gray_guide,"gray-guide") );
+    cmd.add( make_option(0,paramGF.compact_storage,"compact") );
+    cmd.add( make_option(0,paramGF.fixed_point,"fixed") );
+
+    ParamPatchMatch paramPM; // Alternative to cost volume if iterations>0
+    paramPM.iterations = 0;
+    cmd.add( make_option(0,paramPM.iterations,"patchmatch") );
+    cmd.add( make_option(0,paramPM.stride,"pm-stride") );
+    cmd.add( make_option(0,paramPM.seed,"pm-seed") );
+
+    std::string sweepR, sweepE, sweepA, sweepC, sweepG; // Parameter lists
+    std::string gtFile; // Ground truth for errors of sweep
+    cmd.add( make_option(0,sweepR,"sweep-R") );
+    cmd.add( make_option(0,sweepE,"sweep-E") );
+    cmd.add( make_option(0,sweepA,"sweep-A") );
+    cmd.add( make_option(0,sweepC,"sweep-C") );
+    cmd.add( make_option(0,sweepG,"sweep-G") );
+    cmd.add( make_option(0,gtFile,"gt") );
+
+    std::string roiRect, roiMask; // Region of interest
+    bool roiCrop=false; // Disparity map of the size of the region
+    cmd.add( make_option(0,roiRect,"roi") );
+    cmd.add( make_option(0,roiMask,"roi-mask") );
+    cmd.add( make_option(0,roiCrop,"roi-crop") );
 
     ParamOcclusion paramOcc; // Parameters for filling occlusions
     cmd.add( make_option('o',paramOcc.tol_disp) ); // Detect occlusion
@@ -79,9 +454,29 @@ int main(int argc, char *argv[])
     cmd.add( make_option('r',paramOcc.median_radius) );
     cmd.add( make_option('c',paramOcc.sigma_color) );
     cmd.add( make_option('s',paramOcc.sigma_space) );
+    float minConfidence=-1; // Occlusion by confidence if non-negative
+    cmd.add( make_option(0,minConfidence,"confidence") );
 
     cmd.add( make_option('a',grayMin) );
     cmd.add( make_option('b',grayMax) );
+
+    int nFrames=0, firstFrame=0, refresh=10; // Sequence mode
+    ParamWarmStart paramWarm;
+    cmd.add( make_option(0,nFrames,"frames") );
+    cmd.add( make_option(0,firstFrame,"first") );
+    cmd.add( make_option(0,refresh,"refresh") );
+    cmd.add( make_option(0,paramWarm.tile,"tile") );
+    cmd.add( make_option(0,paramWarm.dilation,"dilation") );
+    cmd.add( make_option(0,paramWarm.tolerance,"tolerance") );
+
+    std::string socketPath; // Persistent server mode
+    cmd.add( make_option(0,socketPath,"server") );
+    int cacheSize=-1; // Number of images in guidance cache, negative: default
+    cmd.add( make_option(0,cacheSize,"cache") );
+    std::string profileFile; // JSON report of time spent in each stage
+    cmd.add( make_option(0,profileFile,"profile") );
+    bool estimate=false; // Only print predicted memory
+    cmd.add( make_option(0,estimate,"estimate") );
     try {
         cmd.process(argc, argv);
     } catch(std::string str) {
@@ -89,33 +484,99 @@ int main(int argc, char *argv[])
         usage(argv[0]);
         return 1;
     }
+    if(cacheSize >= 0)
+        set_guidance_cache_size(cacheSize);
+    if(! socketPath.empty()) {
+        if(argc != 1) {
+            std::cerr << "Error: --server takes no image argument" << std::endl;
+            return 1;
+        }
+        return run_server(socketPath.c_str());
+    }
     if(argc!=5) {
         usage(argv[0]);
         return 1;
     }
     bool detectOcc = cmd.used('o') || cmd.used('O');
     bool fillOcc = cmd.used('O');
+    const bool confidence = (minConfidence >= 0);
+    const bool leftRight = detectOcc && !confidence; // Right disparity map
 
-    if(sense != 'r' && sense != 'l') {
-        std::cerr << "Error: invalid camera motion direction " << sense
-                  << " (must be r or l)" << std::endl;
+    if(paramGF.subsample < 1) {
+        std::cerr << "Error: subsampling factor must be positive" << std::endl;
         return 1;
     }
-
-    // Load images
-    size_t width, height, width2, height2;
-    float* pix1 = io_png_read_f32_rgb(argv[1], &width, &height);
-    float* pix2 = io_png_read_f32_rgb(argv[2], &width2, &height2);
-    if(!pix1 || !pix2) {
-        std::cerr << "Cannot read image file " << argv[pix1?2:1] << std::endl;
+    if(paramGF.fixed_point && paramGF.subsample > 1) {
+        std::cerr << "Error: fixed point incompatible with subsampling"
+                  << std::endl;
+        return 1;
+    }
+    const bool patchMatch = (paramPM.iterations > 0);
+    if(patchMatch && (paramGF.subsample>1 || paramGF.compact_storage ||
+                      paramGF.fixed_point || confidence)) {
+        std::cerr << "Error: PatchMatch incompatible with -S, --compact, "
+                  << "--fixed and --confidence" << std::endl;
+        return 1;
+    }
+    const bool sweep = ! (sweepR.empty() && sweepE.empty() && sweepA.empty()
+                          && sweepC.empty() && sweepG.empty());
+    std::vector<ParamGuidedFilter> sweepParams; // All combinations of lists
+    if(sweep) {
+        std::vector<int> R(1, paramGF.kernel_radius);
+        std::vector<float> E(1, paramGF.epsilon), A(1, paramGF.alpha);
+        std::vector<float> C(1, paramGF.color_threshold);
+        std::vector<float> G(1, paramGF.gradient_threshold);
+        if(! (parse_list(sweepR,R) && parse_list(sweepE,E) &&
+              parse_list(sweepA,A) && parse_list(sweepC,C) &&
+              parse_list(sweepG,G))) {
+            std::cerr << "Error reading lists of sweep" << std::endl;
+            return 1;
+        }
+        if(! (in_range(R, 1, std::numeric_limits<int>::max()) &&
+              in_range(E, 0.0f, std::numeric_limits<float>::max(), true) &&
+              in_range(A, 0.0f, 1.0f))) {
+            std::cerr << "Error: sweep needs R>=1, E>0 and A in [0,1]"
+                      << std::endl;
+            return 1;
+        }
+        if(nFrames>0 || patchMatch || confidence || detectOcc || estimate ||
+           paramGF.compact_storage || paramGF.fixed_point) {
+            std::cerr << "Error: sweep incompatible with --frames, "
+                      << "--patchmatch, --confidence, -o, -O, --estimate, "
+                      << "--compact and --fixed" << std::endl;
+            return 1;
+        }
+        ParamGuidedFilter p = paramGF;
+        for(size_t a=0; a<A.size(); a++)
+            for(size_t c=0; c<C.size(); c++)
+                for(size_t g=0; g<G.size(); g++)
+                    for(size_t r=0; r<R.size(); r++)
+                        for(size_t e=0; e<E.size(); e++) {
+                            p.alpha = A[a];
+                            p.color_threshold = C[c];
+                            p.gradient_threshold = G[g];
+                            p.kernel_radius = R[r];
+                            p.epsilon = E[e];
+                            sweepParams.push_back(p);
+                        }
+    }
+    const bool roi = ! (roiRect.empty() && roiMask.empty());
+    if(roi && (nFrames>0 || patchMatch || sweep || leftRight || fillOcc ||
+               estimate)) {
+        std::cerr << "Error: ROI incompatible with --frames, --patchmatch, "
+                  << "sweep, -o (without --confidence), -O and --estimate"
+                  << std::endl;
         return 1;
     }
-    if(width != width2 || height != height2) {
-        std::cerr << "The images must have the same size!" << std::endl;
+    if(paramPM.stride < 1) {
+        std::cerr << "Error: PatchMatch stride must be positive" << std::endl;
+        return 1;
+    }
+    if(sense != 'r' && sense != 'l') {
+        std::cerr << "Error: invalid camera motion direction " << sense
+                  << " (must be r or l)" << std::endl;
         return 1;
     }
-    Image im1(pix1, width, height);
-    Image im2(pix2, width, height);
 
     // Set disparity range
     int dMin, dMax;
@@ -128,46 +589,220 @@ int main(int argc, char *argv[])
         std::cerr << "Wrong disparity range! (dMin > dMax)" << std::endl;
         return 1;
     }
-
-    Image disp = filter_cost_volume(im1, im2, dMin, dMax, paramGF);
-    if(! save_disparity(OUTFILE1, disp, dMin,dMax, grayMin,grayMax)) {
-        std::cerr << "Error writing file " << OUTFILE1 << std::endl;
+    if(dMax-dMin >= 65535) {
+        std::cerr << "Wrong disparity range! (too many disparities)"
+                  << std::endl;
         return 1;
     }
 
-    if(detectOcc) {
-        std::cout << "Detect occlusions...";
-        Image disp2= filter_cost_volume(im2,im1,-dMax,-dMin,paramGF);
-        detect_occlusion(disp, disp2, static_cast<float>(dMin-1),
-                         paramOcc.tol_disp);
-        if(! save_disparity(OUTFILE2, disp, dMin,dMax, grayMin,grayMax))  {
-            std::cerr << "Error writing file " << OUTFILE2 << std::endl;
+    const bool sequence = (nFrames>0);
+    if(! sequence)
+        nFrames = 1;
+    std::ofstream profile;
+    if(! profileFile.empty()) {
+        profile.open(profileFile.c_str());
+        if(! profile) {
+            std::cerr << "Cannot write file " << profileFile << std::endl;
             return 1;
         }
     }
+    Image prevLeft, prevRight; // Raw disparity maps of previous frame
+    for(int f=0; f<nFrames; f++) {
+        if(profile.is_open())
+            profile_start();
+        ProfileTimer timerTotal("total");
+        const int frame = sequence? firstFrame+f: -1;
+        const bool warm = (f>0 && (refresh<=0 || f%refresh!=0) &&
+                           ! patchMatch);
+        if(sequence)
+            std::cout << "Frame " << frame << (warm? "": " (full search)")
+                      << std::endl;
 
-    if(fillOcc) {
-        std::cout << "Post-processing: fill occlusions" << std::endl;
-        Image dispDense = disp.clone();
-        if(sense == 'r')
-            dispDense.fillMaxX(static_cast<float>(dMin));
-        else
-            dispDense.fillMinX(static_cast<float>(dMin));
-        if(! save_disparity(OUTFILE3, dispDense, dMin,dMax, grayMin,grayMax)) {
-            std::cerr << "Error writing file " << OUTFILE3 << std::endl;
+        // Load images
+        std::string name1=frame_name(argv[1],frame);
+        std::string name2=frame_name(argv[2],frame);
+        size_t width, height, width2, height2;
+        ProfileTimer timerLoad("load");
+        float* pix1 = io_png_read_f32_rgb(name1.c_str(), &width, &height);
+        float* pix2 = io_png_read_f32_rgb(name2.c_str(), &width2, &height2);
+        timerLoad.stop();
+        if(!pix1 || !pix2) {
+            std::cerr << "Cannot read image file " << (pix1?name2:name1)
+                      << std::endl;
+            return 1;
+        }
+        if(width != width2 || height != height2) {
+            std::cerr << "The images must have the same size!" << std::endl;
+            return 1;
+        }
+        if(warm && (prevLeft.width()!=(int)width ||
+                    prevLeft.height()!=(int)height)) {
+            std::cerr << "The frames must have the same size!" << std::endl;
+            return 1;
+        }
+        if(estimate) {
+            print_memory_estimate(width, height, paramGF, leftRight,
+                                  confidence, patchMatch);
+            free(pix1);
+            free(pix2);
+            return 0;
+        }
+        Image im1(pix1, width, height);
+        Image im2(pix2, width, height);
+        StereoPairContext pair(im1, im2); // Data shared by both views
+        profile_count("width", static_cast<long>(width));
+        profile_count("height", static_cast<long>(height));
+        int box[4] = {0, 0, (int)width, (int)height}; // Region of interest
+        std::vector<unsigned char> mask;
+        if(roi && ! region_of_interest(roiRect, roiMask, width, height,
+                                       box, mask))
             return 1;
+        if(sweep) { // Single pair, no post-processing
+            if(! run_sweep(pair, dMin, dMax, sweepParams, gtFile,
+                           grayMin, grayMax))
+                return 1;
+            free(pix1);
+            free(pix2);
+            if(profile.is_open()) {
+                timerTotal.stop();
+                profile_stop();
+                profile_write_json(profile);
+            }
+            continue;
         }
 
-        std::cout << "Post-processing: smooth the disparity map" << std::endl;
-        fill_occlusion(dispDense, im1.medianColor(1),
-                       disp, dMin, dMax, paramOcc);
-        if(! save_disparity(OUTFILE4, disp, dMin,dMax, grayMin,grayMax)) {
-            std::cerr << "Error writing file " << OUTFILE4 << std::endl;
+        // With occlusion detection by left-right check, left and right
+        // disparity maps are computed concurrently, each with half of the
+        // threads, the left one being saved while the right one is computed.
+        Image disp, disp2, conf;
+        bool saved=true;
+        ProfileTimer timerMaps(leftRight? "left_right_maps": 0);
+#ifdef _OPENMP
+        omp_set_max_active_levels(2);
+        const int threads = std::max(1, omp_get_max_threads()/2);
+#pragma omp parallel sections num_threads(2) if(leftRight)
+#endif
+        {
+#ifdef _OPENMP
+#pragma omp section
+#endif
+            {
+                if(leftRight)
+                    set_thread_budget(threads);
+                const int tile = std::max(1, paramWarm.tile);
+                const int nTiles = ((int)width+tile-1)/tile *
+                                   (((int)height+tile-1)/tile);
+                std::cout << (patchMatch? "PatchMatch: ": "Cost-volume: ")
+                          << (dMax-dMin+1) << " disparities";
+                if(patchMatch)
+                    std::cout << ", " << paramPM.iterations << " iterations";
+                if(warm)
+                    std::cout << ", warm start on " << nTiles << " tiles";
+                if(roi)
+                    std::cout << ", ROI " << box[2] << 'x' << box[3]
+                              << '+' << box[0] << '+' << box[1];
+                std::cout << ". ";
+                Stars stars(warm? nTiles: patchMatch? 2*paramPM.iterations:
+                            dMax-dMin+1);
+                ProfileTimer timer("cost_volume");
+                Image* pConf = confidence? &conf: 0;
+                disp = patchMatch?
+                    patch_match(pair,0,dMin,dMax,paramGF,paramPM,&stars):
+                    warm?
+                    filter_cost_volume_warm(pair,0,dMin,dMax,prevLeft,
+                                            paramGF,paramWarm,&stars,pConf):
+                    roi?
+                    filter_cost_volume_roi(pair,0,dMin,dMax,
+                                           box[0],box[1],box[2],box[3],
+                                           paramGF,&stars,pConf):
+                    filter_cost_volume(pair,0,dMin,dMax,paramGF,&stars,pConf);
+                timer.stop();
+                if(roi && disp.width() > 0) {
+                    disp = roi_map(disp, box, width, height, mask,
+                                   static_cast<float>(dMin-1), roiCrop);
+                    if(confidence)
+                        conf = roi_map(conf, box, width, height, mask, 0,
+                                       roiCrop);
+                }
+                std::cout << std::endl;
+                saved = save(OUTFILE1, frame, disp, dMin,dMax,
+                             grayMin,grayMax) &&
+                    (! confidence || save(OUTFILE5, frame, conf, 0,1, 0,255));
+            }
+#ifdef _OPENMP
+#pragma omp section
+#endif
+            if(leftRight) {
+                set_thread_budget(threads);
+                ProfileTimer timer("cost_volume");
+                disp2 = patchMatch?
+                    patch_match(pair,1,-dMax,-dMin,paramGF,paramPM):
+                    warm?
+                    filter_cost_volume_warm(pair,1,-dMax,-dMin,prevRight,
+                                            paramGF,paramWarm):
+                    filter_cost_volume(pair,1,-dMax,-dMin,paramGF);
+            }
+        }
+        timerMaps.stop();
+        if(! saved)
             return 1;
+        if(sequence) {
+            prevLeft = disp.clone();
+            prevRight = disp2;
+        }
+
+        if(detectOcc) {
+            std::cout << "Detect occlusions...";
+            ProfileTimer timer(leftRight? "left_right_check": "confidence");
+            if(leftRight)
+                detect_occlusion(disp, disp2, static_cast<float>(dMin-1),
+                                 paramOcc.tol_disp);
+            else
+                detect_low_confidence(disp, conf, static_cast<float>(dMin-1),
+                                      minConfidence);
+            timer.stop();
+            if(sequence) // Warm start only from consistent disparities
+                prevLeft = disp.clone();
+            if(! save(OUTFILE2, frame, disp, dMin,dMax, grayMin,grayMax))
+                return 1;
         }
-    }
 
-    free(pix1);
-    free(pix2);
+        if(fillOcc) {
+            std::cout << "Post-processing: fill occlusions" << std::endl;
+            if(profile_active())
+                profile_count("filled_pixels",
+                              std::count_if(&disp(0,0),
+                                            &disp(0,0)+width*height,
+                                            below(static_cast<float>(dMin))));
+            ProfileTimer timerFill("fill");
+            Image dispDense = disp.clone();
+            if(sense == 'r')
+                dispDense.fillMaxX(static_cast<float>(dMin));
+            else
+                dispDense.fillMinX(static_cast<float>(dMin));
+            timerFill.stop();
+            if(! save(OUTFILE3, frame, dispDense, dMin,dMax, grayMin,grayMax))
+                return 1;
+
+            std::cout << "Post-processing: smooth the disparity map"<<std::endl;
+            ProfileTimer timerMedian("median_color");
+            Image median = pair.medianColor(0);
+            timerMedian.stop();
+            ProfileTimer timerWeighted("weighted_median");
+            fill_occlusion(dispDense, median, disp, dMin, dMax, paramOcc);
+            timerWeighted.stop();
+            if(! save(OUTFILE4, frame, disp, dMin,dMax, grayMin,grayMax))
+                return 1;
+        }
+
+        free(pix1);
+        free(pix2);
+        if(profile.is_open()) {
+            timerTotal.stop();
+            profile_stop();
+            profile_write_json(profile);
+            print_throughput(box[2]*box[3], dMax-dMin+1);
+        }
+    }
     return 0;
 }
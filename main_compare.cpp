@@ -0,0 +1,141 @@
+/**
+ * @file main_compare.cpp
+ * @brief Regression check of disparity maps and running time
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmdLine.h"
+#include "io_png.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+static void usage(const char* name) {
+    std::cerr <<"Stereo Disparity through Cost Aggregation with Guided Filter\n"
+              << "Usage: " << name
+              << " [options] [ref.png out.png ref2.png out2.png ...]\n\n"
+              << "Options (default values in parentheses)\n"
+              << "    -t tol: tolerance of difference of gray levels (0)\n"
+              << "    -p percent: max percentage of pixels above tol (0)\n"
+              << "    --profile file: JSON profile of the run (last line)\n"
+              << "    --baseline sec: reference total time of the run\n"
+              << "    --slowdown f: max ratio of time to baseline (1.2)"
+              << std::endl;
+}
+
+/// Compare images \a ref and \a out, pixels differing by more than \a tol in
+/// a channel are counted. Return whether their percentage is at most
+/// \a percent.
+static bool compare(const char* ref, const char* out, int tol, float percent) {
+    size_t w1, h1, w2, h2;
+    unsigned char* im1 = io_png_read_u8_rgb(ref, &w1, &h1);
+    unsigned char* im2 = io_png_read_u8_rgb(out, &w2, &h2);
+    bool ok = (im1 && im2 && w1==w2 && h1==h2);
+    if(! (im1 && im2))
+        std::cerr << "Cannot read image file " << (im1? out: ref) << std::endl;
+    else if(! ok)
+        std::cerr << out << ": size differs from " << ref << std::endl;
+    else {
+        const size_t n=w1*h1;
+        size_t count=0;
+        int maxDiff=0;
+        for(size_t i=0; i<n; i++) {
+            int d=0;
+            for(int c=0; c<3; c++)
+                d = std::max(d, std::abs(im1[i+c*n]-im2[i+c*n]));
+            maxDiff = std::max(maxDiff, d);
+            if(d > tol)
+                ++count;
+        }
+        const float p = 100.0f*count/n;
+        ok = (p <= percent);
+        std::cout << out << ": " << count << " pixels above tolerance ("
+                  << p << "%), max difference " << maxDiff
+                  << (ok? "": " FAILED") << std::endl;
+    }
+    free(im1);
+    free(im2);
+    return ok;
+}
+
+/// Read total wall time in last line of JSON \a file written by option
+/// --profile of stereoGuidedFilter. Return a negative value in case of error.
+static double total_time(const std::string& file) {
+    std::ifstream in(file.c_str());
+    std::string line, last;
+    while(std::getline(in,line))
+        if(! line.empty())
+            last = line;
+    const std::string key = "{\"name\":\"total\",";
+    std::string::size_type pos = last.find(key);
+    if(pos != std::string::npos)
+        pos = last.find("\"wall\":", pos);
+    double t=-1;
+    if(pos == std::string::npos ||
+       ! (std::istringstream(last.substr(pos+7)) >> t))
+        return -1;
+    return t;
+}
+
+int main(int argc, char *argv[])
+{
+    int tol=0;
+    float percent=0;
+    std::string profileFile;
+    double baseline=0, slowdown=1.2;
+    CmdLine cmd;
+    cmd.add( make_option('t',tol) );
+    cmd.add( make_option('p',percent) );
+    cmd.add( make_option(0,profileFile,"profile") );
+    cmd.add( make_option(0,baseline,"baseline") );
+    cmd.add( make_option(0,slowdown,"slowdown") );
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+    if(argc%2!=1 || (argc<3 && profileFile.empty())) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(! profileFile.empty() && baseline <= 0) {
+        std::cerr << "Error: option --profile requires a positive --baseline"
+                  << std::endl;
+        return 1;
+    }
+
+    bool ok=true;
+    for(int i=1; i+1<argc; i+=2)
+        if(! compare(argv[i], argv[i+1], tol, percent))
+            ok = false;
+
+    if(! profileFile.empty()) {
+        const double t = total_time(profileFile);
+        if(t < 0) {
+            std::cerr << "Cannot read total time in " << profileFile
+                      << std::endl;
+            return 1;
+        }
+        const bool fast = (t <= slowdown*baseline);
+        std::cout << "Time: " << t << "s, baseline " << baseline << "s, ratio "
+                  << t/baseline << (fast? "": " FAILED") << std::endl;
+        ok = ok && fast;
+    }
+    return ok? 0: 1;
+}
@@ -0,0 +1,254 @@
+/**
+ * @file main_synthetic.cpp
+ * @brief Synthetic rectified stereo pair with ground truth disparity
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "image.h"
+#include "cmdLine.h"
+#include "io_png.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+/// Pseudo-random generator, same sequence on all platforms.
+class Random {
+    unsigned int state;
+public:
+    explicit Random(unsigned int seed): state(seed*2654435761u+1) {}
+    /// Uniform value in [a,b)
+    float uniform(float a, float b) {
+        state = state*1664525u + 1013904223u;
+        return a + (b-a)*static_cast<float>(state>>8)/(1<<24);
+    }
+};
+
+/// Planar surface of the scene with disparity d=a+b*x+c*y in the left image
+/// and its own texture. The background has no boundary, the other layers are
+/// rectangles or ellipses.
+struct Layer {
+    float a, b, c; ///< Coefficients of disparity
+    bool ellipse;
+    float x0, y0, rx, ry; ///< Center and half-sizes of shape
+    unsigned int seed; ///< Texture
+    float scale; ///< Size of texture grains in pixels
+    float color[3], contrast;
+
+    float disparity(float x, float y) const { return a+b*x+c*y; }
+    bool inside(float x, float y) const;
+    void texture(float x, float y, unsigned char rgb[3]) const;
+};
+
+/// Is left image point (x,y) in the layer?
+bool Layer::inside(float x, float y) const {
+    if(rx <= 0) // Background
+        return true;
+    const float u=(x-x0)/rx, v=(y-y0)/ry;
+    return ellipse? (u*u+v*v <= 1): (std::abs(u)<=1 && std::abs(v)<=1);
+}
+
+/// Hash of integer point (i,j) for texture \a seed, in [0,1).
+static float hash(int i, int j, unsigned int seed) {
+    unsigned int h = seed ^ (static_cast<unsigned int>(i)*73856093u)
+                          ^ (static_cast<unsigned int>(j)*19349663u);
+    h ^= h>>13; h *= 0x5bd1e995u; h ^= h>>15;
+    return static_cast<float>(h>>8)/(1<<24);
+}
+
+/// Value noise: bilinear interpolation of random values at integer points.
+static float noise(float x, float y, unsigned int seed) {
+    const float fx=std::floor(x), fy=std::floor(y);
+    const int i=static_cast<int>(fx), j=static_cast<int>(fy);
+    const float u=x-fx, v=y-fy;
+    return (1-v)*((1-u)*hash(i,j,seed)   + u*hash(i+1,j,seed)) +
+              v *((1-u)*hash(i,j+1,seed) + u*hash(i+1,j+1,seed));
+}
+
+/// Color at left image point (x,y): 3 octaves of value noise per channel.
+///
+/// The texture is a continuous function of the point, so that both views
+/// sample the same surface.
+void Layer::texture(float x, float y, unsigned char rgb[3]) const {
+    for(int c=0; c<3; c++) {
+        float v=0, amp=0.5f, s=1/scale;
+        for(int o=0; o<3; o++, amp*=0.5f, s*=2)
+            v += amp*noise(x*s, y*s, seed+101*c+7*o);
+        v = color[c] + contrast*(v-0.4375f);
+        rgb[c] = static_cast<unsigned char>(std::min(255.0f,
+                                                     std::max(0.0f, v+0.5f)));
+    }
+}
+
+/// Random scene of \a n layers over the background in image \a w x \a h.
+///
+/// Disparities are in [dFar,dNear], layers being drawn from far to near. The
+/// background is slanted in the farthest 40% of the range, the other layers
+/// are fronto-parallel or slanted in the rest.
+static std::vector<Layer> scene(int w, int h, float dFar, float dNear, int n,
+                                Random& rnd) {
+    std::vector<Layer> layers(n+1);
+    for(int k=0; k<=n; k++) {
+        Layer& L = layers[k];
+        const float t0 = (k==0)? 0: 0.4f+0.6f*(k-1)/n;
+        const float t1 = (k==0)? 0.4f: 0.4f+0.6f*k/n;
+        const float d0 = dFar+t0*(dNear-dFar), d1 = dFar+t1*(dNear-dFar);
+        L.ellipse = (rnd.uniform(0,1) < 0.5f);
+        L.x0 = rnd.uniform(0, static_cast<float>(w));
+        L.y0 = rnd.uniform(0, static_cast<float>(h));
+        L.rx = (k==0)? 0: rnd.uniform(0.05f, 0.25f)*w;
+        L.ry = (k==0)? 0: rnd.uniform(0.05f, 0.25f)*h;
+        // Disparity goes from d0 to d1 along a random direction of the shape
+        const float sx = (k==0)? w*0.5f: L.rx, sy = (k==0)? h*0.5f: L.ry;
+        const bool slanted = (k==0 || rnd.uniform(0,1) < 0.5f);
+        const float angle = rnd.uniform(0, 6.2831853f);
+        const float gx = slanted? std::cos(angle)/sx: 0;
+        const float gy = slanted? std::sin(angle)/sy: 0;
+        const float cx = (k==0)? w*0.5f: L.x0, cy = (k==0)? h*0.5f: L.y0;
+        L.b = 0.5f*(d1-d0)*gx;
+        L.c = 0.5f*(d1-d0)*gy;
+        L.a = 0.5f*(d0+d1) - L.b*cx - L.c*cy;
+        if(! slanted)
+            L.a = rnd.uniform(d0, d1);
+        L.seed = static_cast<unsigned int>(rnd.uniform(0, 1<<24));
+        L.scale = rnd.uniform(2, 12);
+        for(int c=0; c<3; c++)
+            L.color[c] = rnd.uniform(40, 215);
+        L.contrast = rnd.uniform(60, 200);
+    }
+    return layers;
+}
+
+/// Index of visible layer at point \a x2 of line \a y in view of right image,
+/// -1 if none, and its abscissa \a x in left image.
+///
+/// With \a x2 as left image abscissa (\a right false), the visible layer is
+/// simply the topmost layer containing the point.
+static int visible(const std::vector<Layer>& layers, float x2, float y,
+                   bool right, float& x) {
+    for(int k=static_cast<int>(layers.size())-1; k>=0; k--) {
+        const Layer& L = layers[k];
+        x = right? (x2-L.a-L.c*y)/(1+L.b): x2; // Solve x+d(x,y)=x2
+        if(L.inside(x,y))
+            return k;
+    }
+    return -1;
+}
+
+/// Render both views and the ground truth disparity of the left image.
+///
+/// Pixels of the left image that are hidden or out of the right image have
+/// ground truth \a dMin-1 (occlusion).
+static void render(const std::vector<Layer>& layers, int w, int h, int dMin,
+                   unsigned char* im1, unsigned char* im2, Image& gt) {
+    const int n=w*h;
+    for(int y=0; y<h; y++)
+        for(int i=0; i<w; i++) {
+            unsigned char rgb[3];
+            float x;
+            const int k = visible(layers, static_cast<float>(i),
+                                  static_cast<float>(y), false, x);
+            layers[k].texture(x, static_cast<float>(y), rgb);
+            for(int c=0; c<3; c++)
+                im1[c*n+y*w+i] = rgb[c];
+            const float d = layers[k].disparity(x, static_cast<float>(y));
+            const float x2 = x+d;
+            float xBack;
+            const bool seen = (0<=x2 && x2<=w-1 &&
+                               visible(layers, x2, static_cast<float>(y),
+                                       true, xBack)==k);
+            gt(i,y) = seen? d: static_cast<float>(dMin-1);
+
+            const int k2 = visible(layers, static_cast<float>(i),
+                                   static_cast<float>(y), true, x);
+            layers[k2].texture(x, static_cast<float>(y), rgb);
+            for(int c=0; c<3; c++)
+                im2[c*n+y*w+i] = rgb[c];
+        }
+}
+
+static void usage(const char* name) {
+    std::cerr <<"Stereo Disparity through Cost Aggregation with Guided Filter\n"
+              << "Usage: " << name
+              << " [options] width height dmin dmax im1.png im2.png gt.png\n\n"
+              << "Options (default values in parentheses)\n"
+              << "    -n number: number of objects over the background (8)\n"
+              << "    --seed s: seed of random scene (1)\n"
+              << "    -a grayMin: value of gray for min disparity (255)\n"
+              << "    -b grayMax: value of gray for max disparity (0)"
+              << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int grayMin=255, grayMax=0;
+    int nObjects=8, seed=1;
+    CmdLine cmd;
+    cmd.add( make_option('n',nObjects) );
+    cmd.add( make_option(0,seed,"seed") );
+    cmd.add( make_option('a',grayMin) );
+    cmd.add( make_option('b',grayMax) );
+    try {
+        cmd.process(argc, argv);
+    } catch(std::string str) {
+        std::cerr << "Error: " << str << std::endl<<std::endl;
+        usage(argv[0]);
+        return 1;
+    }
+    if(argc!=8) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int w, h, dMin, dMax;
+    if(! ((std::istringstream(argv[1])>>w).eof() &&
+          (std::istringstream(argv[2])>>h).eof() &&
+          (std::istringstream(argv[3])>>dMin).eof() &&
+          (std::istringstream(argv[4])>>dMax).eof())) {
+        std::cerr << "Error reading width, height, dMin or dMax" << std::endl;
+        return 1;
+    }
+    if(w<=0 || h<=0 || nObjects<0) {
+        std::cerr << "Error: size must be positive" << std::endl;
+        return 1;
+    }
+    if(dMin>=dMax) {
+        std::cerr << "Wrong disparity range! (dMin >= dMax)" << std::endl;
+        return 1;
+    }
+
+    // Near objects have the disparity of largest magnitude
+    const bool nearMin = (std::abs(dMin) > std::abs(dMax));
+    const float dNear = static_cast<float>(nearMin? dMin: dMax);
+    const float dFar = static_cast<float>(nearMin? dMax: dMin);
+    Random rnd(static_cast<unsigned int>(seed));
+    std::vector<Layer> layers = scene(w, h, dFar, dNear, nObjects, rnd);
+
+    std::vector<unsigned char> im1(3*static_cast<size_t>(w)*h), im2(im1.size());
+    Image gt(w,h);
+    render(layers, w, h, dMin, &im1[0], &im2[0], gt);
+
+    if(io_png_write_u8(argv[5], &im1[0], w, h, 3) != 0 ||
+       io_png_write_u8(argv[6], &im2[0], w, h, 3) != 0) {
+        std::cerr << "Error writing file " << argv[5] << " or " << argv[6]
+                  << std::endl;
+        return 1;
+    }
+    if(! save_disparity(argv[7], gt, dMin, dMax, grayMin, grayMax)) {
+        std::cerr << "Error writing file " << argv[7] << std::endl;
+        return 1;
+    }
+    return 0;
+}
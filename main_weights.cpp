@@ -20,21 +20,47 @@
 #include "image.h"
 #include "cmdLine.h"
 #include "io_png.h"
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+/// Pixel where weights are computed
+struct Point {
+    int x, y;
+};
+
+struct PatchStats;
 
 // Functions defined below
 Image cut_image(const Image& in, int& x, int& y, int radius);
 Image compute_weights(const Image& in, int x, int y, int radius, float epsilon);
 bool save_weights(const char* fileName,const Image& W, int grayMin,int grayMax);
+static bool save_mosaic(const char* fileName, const PatchStats& stats,
+                        const std::vector<Point>& points, int cols, int r,
+                        int grayMin, int grayMax);
+static bool save_stack(const char* fileName, const PatchStats& stats,
+                       const std::vector<Point>& points, int r);
+static int weights_of_points(Image in, const std::string& pointsFile,
+                             int stride, bool raw, const char* outFile,
+                             int radius, float epsilon,
+                             int grayMin, int grayMax);
 
 static void usage(const char* name, int radius, float epsilon) {
     std::cerr <<"Stereo Disparity through Cost Aggregation with Guided Filter\n"
-              << "Usage: " << name << " [options] in.png x y out.png\n\n"
+              << "Usage: " << name << " [options] in.png x y out.png\n"
+              << "       " << name << " [options] --points file in.png out\n"
+              << "       " << name << " [options] --stride s in.png out\n\n"
               << "Options (default values in parentheses)\n"
               << "    -R radius: radius of the guided filter ("<<radius << ")\n"
               << "    -E epsilon: regularization parameter ("<<epsilon <<")\n"
               << "    -a grayMin: value of gray for min weight (0)\n"
-              << "    -b grayMax: value of gray for max weight (255)"
+              << "    -b grayMax: value of gray for max weight (255)\n"
+              << "    --points file: text file of points x y\n"
+              << "    --stride s: points on a grid of step s\n"
+              << "    --raw: write maps as raw floats instead of PNG mosaic"
               << std::endl;
 }
 
@@ -48,6 +74,12 @@ int main(int argc, char *argv[])
     cmd.add( make_option('E',epsilon) );
     cmd.add( make_option('a',grayMin) );
     cmd.add( make_option('b',grayMax) );
+    std::string pointsFile; // Several points, from file or on grid
+    int stride=0;
+    bool raw=false;
+    cmd.add( make_option(0,pointsFile,"points") );
+    cmd.add( make_option(0,stride,"stride") );
+    cmd.add( make_option(0,raw,"raw") );
     try {
         cmd.process(argc, argv);
     } catch(std::string str) {
@@ -55,7 +87,8 @@ int main(int argc, char *argv[])
         usage(argv[0], radius, epsilon);
         return 1;
     }
-    if(argc!=5) {
+    const bool multi = (! pointsFile.empty() || stride>0);
+    if(argc!=(multi? 3: 5) || (! pointsFile.empty() && stride>0)) {
         usage(argv[0], radius, epsilon);
         return 1;
     }
@@ -68,6 +101,12 @@ int main(int argc, char *argv[])
         return 1;
     }
     Image in(pix, width, height);
+    if(multi) {
+        int status = weights_of_points(in, pointsFile, stride, raw, argv[2],
+                                       radius, epsilon, grayMin, grayMax);
+        free(pix);
+        return status;
+    }
 
     // Get (x,y)
     int x, y;
@@ -188,17 +227,23 @@ static Image covariance(Image im1, Image mean1, Image im2, Image mean2, int r) {
     return (im1*im2).boxFilter(r) - mean1*mean2;
 }
 
-/// Compute weights of guidance filter associated to (x,y).
-Image compute_weights(const Image& in, int x, int y, int r, float epsilon) {
-    Image R=in.r(), G=in.g(), B=in.b();
+/// Means and inverse of regularized covariance of the guide in patches.
+struct PatchStats {
+    Image R, G, B; ///< Channels of the guide
+    Image meanR, meanG, meanB;
+    std::vector<float> inverse; ///< 3x3 matrix at each pixel, eq. (21)
+    PatchStats(const Image& in, int r, float epsilon);
+};
+
+/// Compute the statistics of patches of radius \a r in color image \a in.
+PatchStats::PatchStats(const Image& in, int r, float epsilon)
+: R(in.r()), G(in.g()), B(in.b()) {
     const int width=R.width(), height=R.height();
-    Image W(width,height);
-    std::fill_n(&W(0,0), width*height, 0.0f);
 
     // Compute the mean and variance of each patch, eq. (14)
-    Image meanR = R.boxFilter(r);
-    Image meanG = G.boxFilter(r);
-    Image meanB = B.boxFilter(r);
+    meanR = R.boxFilter(r);
+    meanG = G.boxFilter(r);
+    meanB = B.boxFilter(r);
 
     Image varRR = covariance(R, meanR, R, meanR, r);
     Image varRG = covariance(R, meanR, G, meanG, r);
@@ -207,43 +252,180 @@ Image compute_weights(const Image& in, int x, int y, int r, float epsilon) {
     Image varGB = covariance(G, meanG, B, meanB, r);
     Image varBB = covariance(B, meanB, B, meanB, r);
 
-    Image aR(width,height),aG(width,height),aB(width,height);
-    Image delta(width,height);
-    for(int j=0; j<height; j++)
-        for(int i=0; i<width; i++) {
-            std::fill_n(&delta(0,0), width*height, 0.0f);
-            delta(i,j) = 1.0f;
-            Image meanCost = delta.boxFilter(r); // Eq. (14)
-
-            Image covarRCost = covariance(R, meanR, delta, meanCost, r);
-            Image covarGCost = covariance(G, meanG, delta, meanCost, r);
-            Image covarBCost = covariance(B, meanB, delta, meanCost, r);
-
-            for(int v=0; v<height; v++)
-                for(int u=0; u<width; u++) {
-                    // Computation of (Sigma_k+\epsilon Id)^{-1}
-                    float S1[3*3] = { // Eq. (21)
-                        varRR(u,v)+epsilon, varRG(u,v), varRB(u,v),
-                        varRG(u,v), varGG(u,v)+epsilon, varGB(u,v),
-                        varRB(u,v), varGB(u,v), varBB(u,v)+epsilon };
-                    float S2[3*3];
-                    inverseSym3(S1, S2);
-                    // Eq. (19)
-                    aR(u,v) = covarRCost(u,v) * S2[0] +
-                              covarGCost(u,v) * S2[1] +
-                              covarBCost(u,v) * S2[2];
-                    aG(u,v) = covarRCost(u,v) * S2[3] +
-                              covarGCost(u,v) * S2[4] +
-                              covarBCost(u,v) * S2[5];
-                    aB(u,v) = covarRCost(u,v) * S2[6] +
-                              covarGCost(u,v) * S2[7] +
-                              covarBCost(u,v) * S2[8];
-                }
-            Image b = (meanCost-aR*meanR-aG*meanG-aB*meanB).boxFilter(r);
-            b += aR.boxFilter(r)*R+aG.boxFilter(r)*G+aB.boxFilter(r)*B;
+    // Computation of (Sigma_k+\epsilon Id)^{-1}
+    inverse.resize(9*static_cast<size_t>(width)*height);
+    for(int v=0; v<height; v++)
+        for(int u=0; u<width; u++) {
+            float S1[3*3] = { // Eq. (21)
+                varRR(u,v)+epsilon, varRG(u,v), varRB(u,v),
+                varRG(u,v), varGG(u,v)+epsilon, varGB(u,v),
+                varRB(u,v), varGB(u,v), varBB(u,v)+epsilon };
+            inverseSym3(S1, &inverse[9*(v*width+u)]);
+        }
+}
 
-            W(i,j) = b(x,y);
+/// Add weights of guidance filter associated to (x,y) to \a W, whose pixel
+/// (0,0) is (x0,y0) in the guide.
+///
+/// Closed form of the weight of pixel j in the output at pixel i=(x,y):
+/// W(j) = 1/n_i sum_{k in w_i, j in w_k} 1/n_k (1+(I_j-mu_k)^T S_k (I_i-mu_k))
+/// with w_k the patch of radius \a r centered at k, n_k its number of pixels,
+/// mu_k the mean of the guide in w_k and S_k the inverse of its regularized
+/// covariance, eq. (21). This is what the filter gives with a Dirac at j as
+/// input, but computed in O(r^4) operations instead of running the filter for
+/// each j.
+static void add_weights(const PatchStats& st, int x, int y, int r,
+                        Image& W, int x0, int y0) {
+    const Image &R=st.R, &G=st.G, &B=st.B;
+    const int width=R.width(), height=R.height();
+    const int u0=std::max(0,x-r), u1=std::min(width-1,x+r);
+    const int v0=std::max(0,y-r), v1=std::min(height-1,y+r);
+    const float ni = static_cast<float>((u1-u0+1)*(v1-v0+1));
+    for(int v=v0; v<=v1; v++)
+        for(int u=u0; u<=u1; u++) { // Patches w_k containing (x,y)
+            const float* S2 = &st.inverse[9*(v*width+u)];
+            const float m[3] = {st.meanR(u,v), st.meanG(u,v), st.meanB(u,v)};
+            const float d[3] = {R(x,y)-m[0], G(x,y)-m[1], B(x,y)-m[2]};
+            float s[3]; // S_k (I_i-mu_k)
+            for(int c=0; c<3; c++)
+                s[c] = S2[3*c]*d[0] + S2[3*c+1]*d[1] + S2[3*c+2]*d[2];
+            const int j0=std::max(0,u-r), j1=std::min(width-1,u+r);
+            const int i0=std::max(0,v-r), i1=std::min(height-1,v+r);
+            const float w = 1/(ni*(j1-j0+1)*(i1-i0+1));
+            for(int j=i0; j<=i1; j++)
+                for(int i=j0; i<=j1; i++)
+                    W(i-x0,j-y0) += w*(1 + (R(i,j)-m[0])*s[0] +
+                                           (G(i,j)-m[1])*s[1] +
+                                           (B(i,j)-m[2])*s[2]);
         }
+}
 
+/// Compute weights of guidance filter associated to (x,y).
+Image compute_weights(const Image& in, int x, int y, int r, float epsilon) {
+    PatchStats stats(in, r, epsilon);
+    const int width=in.width(), height=in.height();
+    Image W(width,height);
+    std::fill_n(&W(0,0), width*height, 0.0f);
+    add_weights(stats, x, y, r, W, 0, 0);
     return W;
 }
+
+/// Weights at (x,y) in image of size 4r+1 centered at (x,y), NaN outside the
+/// guide.
+static Image weight_map(const PatchStats& stats, int x, int y, int r) {
+    const int side=4*r+1, x0=x-2*r, y0=y-2*r;
+    const int width=stats.R.width(), height=stats.R.height();
+    Image W(side,side);
+    for(int j=0; j<side; j++)
+        for(int i=0; i<side; i++)
+            W(i,j) = (0<=x0+i && x0+i<width && 0<=y0+j && y0+j<height)? 0:
+                std::numeric_limits<float>::quiet_NaN();
+    add_weights(stats, x, y, r, W, x0, y0);
+    return W;
+}
+
+/// Save weight maps of \a points in a mosaic of \a cols columns, each map
+/// with its own affine weight->gray function. Pixels outside the image and
+/// between maps are in cyan.
+static bool save_mosaic(const char* fileName, const PatchStats& stats,
+                        const std::vector<Point>& points, int cols, int r,
+                        int grayMin, int grayMax) {
+    const int side=4*r+1;
+    const size_t n=points.size(), c=static_cast<size_t>(cols);
+    const size_t rows=(n+c-1)/c;
+    const size_t w=c*(side+1)-1, h=rows*(side+1)-1, plane=w*h;
+    std::vector<unsigned char> out(3*plane, 0);
+    std::fill(out.begin()+plane, out.end(), 255);
+    for(size_t t=0; t<n; t++) {
+        Image W = weight_map(stats, points[t].x, points[t].y, r);
+        float m=std::numeric_limits<float>::max(), M=-m;
+        for(int j=0; j<side; j++)
+            for(int i=0; i<side; i++)
+                if(W(i,j) == W(i,j)) { // Not NaN
+                    m = std::min(m, W(i,j));
+                    M = std::max(M, W(i,j));
+                }
+        const float a=(M>m)? (grayMax-grayMin)/(M-m): 0;
+        const float b=(M>m)? (grayMin*M-grayMax*m)/(M-m): grayMax;
+        const size_t X=(t%c)*(side+1), Y=(t/c)*(side+1);
+        for(int j=0; j<side; j++)
+            for(int i=0; i<side; i++) {
+                if(W(i,j) != W(i,j)) // NaN, outside image
+                    continue;
+                float v = a*W(i,j) + b + 0.5f;
+                v = std::min(std::max(v,0.0f), 255.0f);
+                const size_t k = (Y+j)*w + X+i;
+                out[k] = out[k+plane] = out[k+2*plane] =
+                    static_cast<unsigned char>(v);
+            }
+    }
+    return (io_png_write_u8(fileName, &out[0], w, h, 3) == 0);
+}
+
+/// Save weight maps of \a points in raw file: int number of maps, int side,
+/// then for each map int x, int y and side*side floats (NaN outside image).
+static bool save_stack(const char* fileName, const PatchStats& stats,
+                       const std::vector<Point>& points, int r) {
+    std::ofstream file(fileName, std::ios::binary);
+    const int n=static_cast<int>(points.size()), side=4*r+1;
+    file.write(reinterpret_cast<const char*>(&n), sizeof(int));
+    file.write(reinterpret_cast<const char*>(&side), sizeof(int));
+    for(int t=0; t<n && file; t++) {
+        Image W = weight_map(stats, points[t].x, points[t].y, r);
+        file.write(reinterpret_cast<const char*>(&points[t]), sizeof(Point));
+        file.write(reinterpret_cast<const char*>(&W(0,0)),
+                   side*side*sizeof(float));
+    }
+    return ! file.fail();
+}
+
+/// Compute weight maps of points read in \a pointsFile or on a grid of step
+/// \a stride and save them in \a outFile, as a mosaic or a raw stack.
+///
+/// The statistics of patches are computed once for the whole image.
+static int weights_of_points(Image in, const std::string& pointsFile,
+                             int stride, bool raw, const char* outFile,
+                             int radius, float epsilon,
+                             int grayMin, int grayMax) {
+    const int width=in.width(), height=in.height();
+    std::vector<Point> points;
+    int cols=0; // Number of columns of mosaic
+    if(stride > 0) {
+        for(int y=stride/2; y<height; y+=stride)
+            for(int x=stride/2; x<width; x+=stride) {
+                Point p = {x, y};
+                points.push_back(p);
+            }
+        cols = (width-stride/2+stride-1)/stride;
+    } else {
+        std::ifstream file(pointsFile.c_str());
+        Point p;
+        while(file >> p.x >> p.y) {
+            if(! (0<=p.x && p.x<width && 0<=p.y && p.y<height)) {
+                std::cerr << "Error: point (" << p.x << ',' << p.y
+                          << ") must be inside the image" << std::endl;
+                return 1;
+            }
+            points.push_back(p);
+        }
+        if(! file.eof()) {
+            std::cerr << "Error reading file " << pointsFile << std::endl;
+            return 1;
+        }
+        while(cols*cols < static_cast<int>(points.size()))
+            ++cols;
+    }
+    if(points.empty()) {
+        std::cerr << "Error: no point" << std::endl;
+        return 1;
+    }
+
+    PatchStats stats(in, radius, epsilon);
+    bool ok = raw? save_stack(outFile, stats, points, radius):
+        save_mosaic(outFile, stats, points, cols, radius, grayMin, grayMax);
+    if(! ok) {
+        std::cerr << "Error writing file " << outFile << std::endl;
+        return 1;
+    }
+    return 0;
+}
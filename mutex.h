@@ -0,0 +1,63 @@
+/**
+ * @file mutex.h
+ * @brief Mutual exclusion between threads
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MUTEX_H
+#define MUTEX_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/// Mutex, critical section on Windows.
+///
+/// A mutex at namespace scope is constructed before main, so before any
+/// thread can use it.
+class Mutex {
+#ifdef _WIN32
+    CRITICAL_SECTION m;
+public:
+    Mutex() { InitializeCriticalSection(&m); }
+    ~Mutex() { DeleteCriticalSection(&m); }
+    void lock() { EnterCriticalSection(&m); }
+    void unlock() { LeaveCriticalSection(&m); }
+#else
+    pthread_mutex_t m;
+public:
+    Mutex() { pthread_mutex_init(&m, 0); }
+    ~Mutex() { pthread_mutex_destroy(&m); }
+    void lock() { pthread_mutex_lock(&m); }
+    void unlock() { pthread_mutex_unlock(&m); }
+#endif
+private:
+    Mutex(const Mutex&); ///< Not copyable
+    Mutex& operator=(const Mutex&);
+};
+
+/// Lock of a Mutex for the lifetime of the object.
+class MutexLock {
+    Mutex& m;
+public:
+    explicit MutexLock(Mutex& mutex): m(mutex) { m.lock(); }
+    ~MutexLock() { m.unlock(); }
+private:
+    MutexLock(const MutexLock&); ///< Not copyable
+    MutexLock& operator=(const MutexLock&);
+};
+
+#endif
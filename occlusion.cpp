@@ -18,19 +18,49 @@
 
 #include "occlusion.h"
 #include "image.h"
+#include "progress.h"
 #include <cstdlib>
+#include <vector>
 
 /// Detect left-right discrepancies in disparity and put incoherent pixels to
 /// value \a dOcclusion in \a disparityLeft.
+///
+/// Progress is reported to \a progress, if not null, every 64 lines. If
+/// cancelled, \a disparityLeft is unchanged.
 void detect_occlusion(Image& disparityLeft, const Image& disparityRight,
-                      float dOcclusion, int tolDisp) {
+                      float dOcclusion, int tolDisp, Progress* progress) {
     const int w=disparityLeft.width(), h=disparityLeft.height();
-    for(int y=0; y<h; y++)
+    std::vector<int> occluded; // Indices of pixels, applied once all checked
+    for(int y=0; y<h; y++) {
+        if(progress && y%64==0 &&
+           ! progress->report("left_right_check", static_cast<float>(y)/h))
+            return;
         for(int x=0; x<w; x++) {
             int d = (int)disparityLeft(x,y);
             if(x+d<0 || x+d>=w || abs(d+(int)disparityRight(x+d,y))>tolDisp)
-                disparityLeft(x,y) = dOcclusion;
+                occluded.push_back(y*w+x);
         }
+    }
+    if(progress && ! progress->report("left_right_check", 1))
+        return;
+    float* disp = &disparityLeft(0,0);
+    for(size_t i=0; i<occluded.size(); i++)
+        disp[occluded[i]] = dOcclusion;
+}
+
+/// Put pixels of \a disparity whose \a confidence is below \a minConfidence to
+/// value \a dOcclusion.
+///
+/// This replaces the left-right check when only the disparity map of the left
+/// image is computed. Occlusions and ambiguous matches both have low
+/// confidence, but other pixels too, depending on the threshold.
+void detect_low_confidence(Image& disparity, const Image& confidence,
+                           float dOcclusion, float minConfidence) {
+    const int w=disparity.width(), h=disparity.height();
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            if(confidence(x,y) < minConfidence)
+                disparity(x,y) = dOcclusion;
 }
 
 /// Fill occlusions by weighted median filtering.
@@ -40,12 +70,17 @@ void detect_occlusion(Image& disparityLeft, const Image& disparityRight,
 /// \param disparity Values outside [dispMin,dispMax] are interpolated
 /// \param dispMin,dispMax Min/max disparities
 /// \param paramOcc Parameters to compute weights in bilateral filtering
+/// \param progress If not null, receives progress, \a disparity is unchanged
+/// if cancelled
 void fill_occlusion(const Image& dispDense, const Image& guidance,
                     Image& disparity, int dispMin, int dispMax,
-                    const ParamOcclusion& paramOcc) {
-    disparity = dispDense.weightedMedianColor(guidance,
-                                              disparity, dispMin, dispMax, 
-                                              paramOcc.median_radius,
-                                              paramOcc.sigma_space,
-                                              paramOcc.sigma_color);
+                    const ParamOcclusion& paramOcc, Progress* progress) {
+    Image median = dispDense.weightedMedianColor(guidance,
+                                                 disparity, dispMin, dispMax,
+                                                 paramOcc.median_radius,
+                                                 paramOcc.sigma_space,
+                                                 paramOcc.sigma_color,
+                                                 progress);
+    if(! (progress && progress->cancelled()))
+        disparity = median;
 }
@@ -20,6 +20,7 @@
 #define OCCLUSION_H
 
 class Image;
+class Progress;
 
 /// Parameters for filling occlusions
 struct ParamOcclusion {
@@ -37,8 +38,10 @@ struct ParamOcclusion {
 };
 
 void detect_occlusion(Image& disparityLeft, const Image& disparityRight,
-                      float dOcclusion, int tol_disp);
+                      float dOcclusion, int tol_disp, Progress* progress=0);
+void detect_low_confidence(Image& disparity, const Image& confidence,
+                           float dOcclusion, float minConfidence);
 void fill_occlusion(const Image& dispDense, const Image& guidance,
                     Image& disparity, int dispMin, int dispMax,
-                    const ParamOcclusion& paramOcc);
+                    const ParamOcclusion& paramOcc, Progress* progress=0);
 #endif
@@ -0,0 +1,362 @@
+/**
+ * @file patchMatch.cpp
+ * @brief Disparity search by randomized propagation (PatchMatch)
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "patchMatch.h"
+#include "costVolume.h"
+#include "guidance.h"
+#include "image.h"
+#include "profile.h"
+#include "progress.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+/// Pixels of a view and of the other one for the matching cost, eq. (7).
+///
+/// The color channels and the x-derivative of each pixel are interleaved, so
+/// that the cost of a pixel reads 2 consecutive groups of 4 floats.
+struct Matcher {
+    Image pix1; ///< View, 4*w x h
+    Image pix2; ///< Other view
+    float alpha, maxColor, maxGrad, maxCost;
+    Matcher(StereoPairContext& pair, int view, const ParamGuidedFilter& param);
+    float cost(const float* p1, const float* p2) const;
+    static long long memory(int w, int h);
+};
+
+/// Interleave channels of \a color and \a gradient in image 4 times wider.
+static Image interleave(Image color, Image gradient) {
+    const int w=gradient.width(), h=gradient.height();
+    Image R=color.r(), G=color.g(), B=color.b();
+    Image out(4*w,h);
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            float* p = &out(4*x,y);
+            p[0]=R(x,y); p[1]=G(x,y); p[2]=B(x,y); p[3]=gradient(x,y);
+        }
+    return out;
+}
+
+/// Images of \a view in \a pair and thresholds of \a param.
+Matcher::Matcher(StereoPairContext& pair, int view,
+                 const ParamGuidedFilter& param)
+: pix1(interleave(pair.image(view), pair.features(view).gradient)),
+  pix2(interleave(pair.image(1-view), pair.features(1-view).gradient)),
+  alpha(param.alpha),
+  maxColor(param.color_threshold), maxGrad(param.gradient_threshold),
+  maxCost((1-alpha)*maxColor + alpha*maxGrad) {}
+
+/// Bytes of the interleaved images of a view of size \a w x \a h and of the
+/// other one.
+long long Matcher::memory(int w, int h) {
+    return 2*Image::memory(4*w,h);
+}
+
+/// Matching cost of pixel \a p1 with pixel \a p2, the same as the one of the
+/// cost volume: blend of truncated color and x-derivative differences.
+inline float Matcher::cost(const float* p1, const float* p2) const {
+    const float color = (std::abs(p1[0]-p2[0]) + // Eq. (2)
+                         std::abs(p1[1]-p2[1]) +
+                         std::abs(p1[2]-p2[2]))/3;
+    const float grad = std::abs(p1[3]-p2[3]); // Eq. (5)
+    return (1-alpha)*std::min(color,maxColor) + // Eqs. (3), (6), (7)
+           alpha*std::min(grad,maxGrad);
+}
+
+/// Support weights of the patch centered at each pixel p, those of the guided
+/// filter restricted to this single patch:
+/// W(p,q) = 1 + (I_p-mu_p)^T (Sigma_p+epsilon Id)^{-1} (I_q-mu_p).
+///
+/// It is affine in I_q: W(p,q) = c_0(p) + sum_c c_{1+c}(p) I_q^c, the
+/// coefficients being interleaved in \a coef. Negative weights are clamped to
+/// 0, since a single patch does not have the smoothing of the average over
+/// the patches containing p and q. The guide is the color of pixels of the
+/// Matcher, or \a gray.
+struct Support {
+    Image gray; ///< Gray guide, empty for color guide
+    Image coef; ///< 4*w x h
+    Support(const GuideStats& stats, Image guide);
+    static long long memory(int w, int h);
+};
+
+/// Bytes of the coefficients for an image of size \a w x \a h, the gray guide
+/// being shared.
+long long Support::memory(int w, int h) {
+    return Image::memory(4*w,h);
+}
+
+/// Coefficients of weights from statistics \a stats of image \a im.
+Support::Support(const GuideStats& stats, Image im)
+: coef(4*stats.meanR.width(), stats.meanR.height()) {
+    const int w=stats.meanR.width(), h=stats.meanR.height();
+    if(stats.channels == 1) {
+        gray = im;
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++) {
+                const float mu = stats.meanR(x,y);
+                const float v = stats.invRR(x,y)*(im(x,y)-mu);
+                float* c = &coef(4*x,y);
+                c[0] = 1-v*mu;
+                c[1] = v;
+                c[2] = c[3] = 0;
+            }
+        return;
+    }
+    Image R=im.r(), G=im.g(), B=im.b();
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++) {
+            const float mu[3] = {stats.meanR(x,y),stats.meanG(x,y),
+                                 stats.meanB(x,y)};
+            const float d[3] = {R(x,y)-mu[0], G(x,y)-mu[1], B(x,y)-mu[2]};
+            float* c = &coef(4*x,y);
+            c[1] = stats.invRR(x,y)*d[0]+stats.invRG(x,y)*d[1]+
+                   stats.invRB(x,y)*d[2];
+            c[2] = stats.invRG(x,y)*d[0]+stats.invGG(x,y)*d[1]+
+                   stats.invGB(x,y)*d[2];
+            c[3] = stats.invRB(x,y)*d[0]+stats.invGB(x,y)*d[1]+
+                   stats.invBB(x,y)*d[2];
+            c[0] = 1-c[1]*mu[0]-c[2]*mu[1]-c[3]*mu[2];
+        }
+}
+
+/// Pixel of the patch of the pixel being improved with positive weight.
+struct Sample {
+    int x; ///< Column
+    int index; ///< Index of first float of pixel in Matcher images
+    float weight;
+};
+
+/// Fill \a samples with the pixels of patch of radius \a r of (x,y) with
+/// positive support weight, every \a stride pixels in both directions from
+/// (x,y).
+///
+/// The weights of the patch do not depend on the disparity, so that they are
+/// computed once for all disparities tried at the pixel.
+template <int channels>
+static void sample_patch(const Matcher& m, const Support& s, int x, int y,
+                         int r, int stride, std::vector<Sample>& samples) {
+    const int w=m.pix1.width()/4, h=m.pix1.height();
+    const int k = r/stride*stride; // Farthest offset sampled
+    int x0=x-k, y0=y-k;
+    while(x0 < 0) x0 += stride;
+    while(y0 < 0) y0 += stride;
+    const int x1=std::min(w-1,x+k), y1=std::min(h-1,y+k);
+    Image& pix1=const_cast<Image&>(m.pix1); // Only for raw pointers to rows
+    Image& gray=const_cast<Image&>(s.gray);
+    const float* c = &const_cast<Image&>(s.coef)(4*x,y);
+    samples.clear();
+    for(int j=y0; j<=y1; j+=stride) {
+        const float* p1 = &pix1(0,j);
+        const float* g = (channels==1)? &gray(0,j): 0;
+        for(int i=x0; i<=x1; i+=stride) {
+            const float* q = p1+4*i;
+            const float weight = (channels==1)? c[0]+c[1]*g[i]:
+                c[0]+c[1]*q[0]+c[2]*q[1]+c[3]*q[2];
+            if(weight > 0) {
+                Sample sample = {i, 4*(j*w+i), weight};
+                samples.push_back(sample);
+            }
+        }
+    }
+}
+
+/// Aggregated cost at disparity \a d of the pixel of patch \a samples: sum of
+/// the matching costs of the samples weighted by their support. Pixels
+/// matched outside the other image have the max cost.
+///
+/// The weights of the patch being the same for all disparities, aggregated
+/// costs of a pixel can be compared without normalization. The terms being
+/// non-negative, the sum is stopped as soon as it reaches \a bound.
+static float aggregate(const Matcher& m, const std::vector<Sample>& samples,
+                       int d, float bound) {
+    const int w=m.pix1.width()/4;
+    const float* pix1 = &const_cast<Image&>(m.pix1)(0,0);
+    const float* pix2 = &const_cast<Image&>(m.pix2)(0,0);
+    float sum=0;
+    for(std::vector<Sample>::const_iterator it=samples.begin();
+        it!=samples.end() && sum<bound; ++it) {
+        const int x2 = it->x+d;
+        sum += it->weight*((0<=x2 && x2<w)?
+                           m.cost(pix1+it->index, pix2+it->index+4*d):
+                           m.maxCost);
+    }
+    return sum;
+}
+
+/// Pseudo-random number from \a seed and three integers, the same on all
+/// platforms and whatever the order of computations (murmur3 finalizer).
+static unsigned int pseudo_random(unsigned int seed, int a, int b, int c) {
+    unsigned int h = seed;
+    const int v[3] = {a, b, c};
+    for(int i=0; i<3; i++) {
+        h ^= static_cast<unsigned int>(v[i]);
+        h ^= h>>16; h *= 0x85ebca6bu;
+        h ^= h>>13; h *= 0xc2b2ae35u;
+        h ^= h>>16;
+    }
+    return h;
+}
+
+/// Offsets of neighbors whose disparity is propagated, at odd distance so that
+/// they have the other color of the checkerboard.
+static const int NEIGHBORS[8][2] = {{-1,0},{1,0},{0,-1},{0,1},
+                                    {-5,0},{5,0},{0,-5},{0,5}};
+
+/// Number of random disparities tried at each pixel and iteration
+static const int REFINEMENTS=2;
+
+/// Improve disparity of pixel (x,y) with weights \a samples of its patch: try
+/// disparities of neighbors, then random disparities around the best one in
+/// intervals whose radius halves at each try, from half the range at
+/// iteration 0 (so 1/2, 1/4, then 1/8, 1/16 at iteration 1...).
+/// Return the number of aggregated costs computed.
+static int improve(const Matcher& m, const std::vector<Sample>& samples,
+                   int x, int y, int dispMin, int dispMax,
+                   const ParamPatchMatch& pm, int iteration,
+                   Image& disparity, Image& cost) {
+    const int w=disparity.width(), h=disparity.height();
+    int best = static_cast<int>(disparity(x,y));
+    float bestCost = cost(x,y);
+    int tried[1+8+REFINEMENTS], n=0; // Disparities already evaluated
+    tried[n++] = best;
+    for(int k=0; k<8+REFINEMENTS; k++) {
+        int d;
+        if(k < 8) { // Propagation
+            const int i=x+NEIGHBORS[k][0], j=y+NEIGHBORS[k][1];
+            if(i<0 || i>=w || j<0 || j>=h)
+                continue;
+            d = static_cast<int>(disparity(i,j));
+        } else { // Refinement
+            const int shift = 1 + REFINEMENTS*iteration + k-8; // Try number
+            const int radius = (shift<31)? (dispMax-dispMin+1)>>shift: 0;
+            if(radius < 1)
+                break;
+            const unsigned int u = pseudo_random(pm.seed, y*w+x, iteration,k);
+            d = best - radius + static_cast<int>(u%(2*radius+1));
+            d = std::min(dispMax, std::max(dispMin, d));
+        }
+        if(std::find(tried, tried+n, d) != tried+n)
+            continue;
+        tried[n++] = d;
+        const float c = aggregate(m, samples, d, bestCost);
+        if(c < bestCost) {
+            best = d;
+            bestCost = c;
+        }
+    }
+    disparity(x,y) = static_cast<float>(best);
+    cost(x,y) = bestCost;
+    return n-1;
+}
+
+/// Random initialization, then iterations of propagation and refinement on
+/// the pixels of a color of the checkerboard followed by the other ones.
+/// Return false if cancelled.
+template <int channels>
+static bool search(const Matcher& m, const Support& s,
+                   int dispMin, int dispMax, const ParamGuidedFilter& param,
+                   const ParamPatchMatch& pm, Progress* progress,
+                   Image& disparity) {
+    const int w=disparity.width(), h=disparity.height();
+    const int r = param.kernel_radius;
+    Image cost(w,h);
+    long evaluations = static_cast<long>(w)*h;
+    ProfileTimer timerInit("patch_match_init");
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h))
+#endif
+    for(int y=0; y<h; y++) {
+        std::vector<Sample> samples;
+        for(int x=0; x<w; x++) {
+            const unsigned int u = pseudo_random(pm.seed, y*w+x, -1, 0);
+            const int d = dispMin+static_cast<int>(u%(dispMax-dispMin+1));
+            sample_patch<channels>(m, s, x, y, r, pm.stride, samples);
+            disparity(x,y) = static_cast<float>(d);
+            cost(x,y) = aggregate(m, samples, d,
+                                  std::numeric_limits<float>::max());
+        }
+    }
+    timerInit.stop();
+    const int steps = 2*pm.iterations;
+    for(int step=0; step<steps; step++) {
+        ProfileTimer timer("propagation");
+        const int color = step%2; // Pixels with (x+y)%2==color
+        long n=0;
+#ifdef _OPENMP
+#pragma omp parallel for if(parallel_rows(w,h)) reduction(+:n)
+#endif
+        for(int y=0; y<h; y++) {
+            std::vector<Sample> samples;
+            for(int x=(y+color)%2; x<w; x+=2) {
+                sample_patch<channels>(m, s, x, y, r, pm.stride, samples);
+                n += improve(m, samples, x, y, dispMin, dispMax, pm, step/2,
+                             disparity, cost);
+            }
+        }
+        evaluations += n;
+        timer.stop();
+        if(progress && ! progress->report("patch_match",
+                                          static_cast<float>(step+1)/steps))
+            return false;
+    }
+    profile_count("aggregated_costs", evaluations);
+    return true;
+}
+
+/// Disparity map of image of \a view in \a pair by PatchMatch search in
+/// [dispMin,dispMax], with the matching cost and the radius, epsilon and
+/// guide of \a param.
+///
+/// Each pixel starts with a random disparity. At each iteration, the pixels
+/// of a checkerboard color are processed in parallel, then those of the other
+/// color: each one takes the disparity of a neighbor or a random perturbation
+/// of its own if it lowers its aggregated cost. A pixel tries at most 11
+/// disparities per iteration, so that the time depends on the number of
+/// iterations, not on the range. Disparities are integers, no pixel being
+/// marked as occluded. The result does not depend on the number of threads.
+/// If cancelled, the returned image is empty.
+Image patch_match(StereoPairContext& pair, int view, int dispMin, int dispMax,
+                  const ParamGuidedFilter& param, const ParamPatchMatch& pm,
+                  Progress* progress) {
+    const int channels = param.gray_guide? 1: 3;
+    Image guide = param.gray_guide? pair.features(view).gray: pair.image(view);
+    Support support(pair.guide(view, channels, 1, param.kernel_radius,
+                               param.epsilon), guide);
+    Matcher m(pair, view, param); // After the temporaries of statistics
+    Image disparity(m.pix1.width()/4, m.pix1.height());
+    profile_count("disparities", dispMax-dispMin+1);
+    const bool ok = (channels==1)?
+        search<1>(m, support, dispMin, dispMax, param, pm, progress, disparity):
+        search<3>(m, support, dispMin, dispMax, param, pm, progress, disparity);
+    return ok? disparity: Image();
+}
+
+/// Predicted peak memory (bytes) of images allocated by patch_match for input
+/// images of size \a width x \a height, see filter_cost_volume_memory.
+///
+/// The peak is in the search: the interleaved pixels of both images, the
+/// coefficients of weights, the disparity and cost maps, the features of both
+/// images and the statistics of the guide. Neither the disparity range nor
+/// the radius changes the size of a buffer, the samples of patches being
+/// gathered for one pixel at a time.
+long long patch_match_memory(int width, int height,
+                             const ParamGuidedFilter& param) {
+    return Matcher::memory(width,height) + Support::memory(width,height) +
+        2*Image::memory(width,height) + 2*ImageFeatures::memory(width,height) +
+        GuideStats::memory(width, height, param.gray_guide? 1: 3);
+}
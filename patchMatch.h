@@ -0,0 +1,45 @@
+/**
+ * @file patchMatch.h
+ * @brief Disparity search by randomized propagation (PatchMatch)
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATCHMATCH_H
+#define PATCHMATCH_H
+
+class Image;
+class Progress;
+class StereoPairContext;
+struct ParamGuidedFilter;
+
+/// Parameters of the PatchMatch search
+struct ParamPatchMatch {
+    int iterations; ///< Number of sweeps of propagation and refinement
+    int stride; ///< Step between pixels of patches summed in aggregated costs
+    unsigned int seed; ///< Seed of random initialization and refinement
+
+    /// Constructor with default parameters
+    ParamPatchMatch()
+    : iterations(3),
+      stride(2),
+      seed(0) {}
+};
+
+Image patch_match(StereoPairContext& pair, int view, int dispMin, int dispMax,
+                  const ParamGuidedFilter& param, const ParamPatchMatch& pm,
+                  Progress* progress=0);
+long long patch_match_memory(int width, int height,
+                             const ParamGuidedFilter& param);
+
+#endif
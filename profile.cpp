@@ -0,0 +1,217 @@
+/**
+ * @file profile.cpp
+ * @brief Time spent in each stage of the program, reported in JSON
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+#include "image.h"
+#include "mutex.h"
+#include <ctime>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+/// Accumulated times of a stage
+struct StageTime {
+    std::string name;
+    long calls;
+    double wall, cpu; ///< In seconds
+    long long peak; ///< Max of peak memory of images during calls
+};
+
+/// Value of a counter
+struct Counter {
+    std::string name;
+    long value;
+};
+
+/// Stages and counters in order of first appearance
+static std::vector<StageTime> stages;
+static std::vector<Counter> counters;
+static volatile bool active = false;
+
+/// Mutual exclusion for records from concurrent threads.
+static Mutex profileMutex;
+
+/// Wall clock time in seconds, from an arbitrary origin.
+static double wall_time() {
+#ifdef _WIN32
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return static_cast<double>(t.QuadPart)/static_cast<double>(f.QuadPart);
+#else
+    timeval t;
+    gettimeofday(&t, 0);
+    return t.tv_sec + 1e-6*t.tv_usec;
+#endif
+}
+
+/// CPU time of the process in seconds.
+static double cpu_time() {
+    return static_cast<double>(std::clock())/CLOCKS_PER_SEC;
+}
+
+/// Maximum resident memory (bytes) of the process so far, 0 if unknown.
+long long profile_resident_memory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS m;
+    if(! GetProcessMemoryInfo(GetCurrentProcess(), &m, sizeof(m)))
+        return 0;
+    return static_cast<long long>(m.PeakWorkingSetSize);
+#else
+    rusage u;
+    if(getrusage(RUSAGE_SELF, &u) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<long long>(u.ru_maxrss); // Bytes
+#else
+    return 1024*static_cast<long long>(u.ru_maxrss); // Kilobytes
+#endif
+#endif
+}
+
+/// Clear records and start profiling. The peak memory of images is reset.
+void profile_start() {
+    MutexLock lock(profileMutex);
+    stages.clear();
+    counters.clear();
+    image_memory_reset_peak();
+    active = true;
+}
+
+/// Stop profiling, records are kept.
+void profile_stop() {
+    active = false;
+}
+
+/// Whether stages are currently measured.
+bool profile_active() {
+    return active;
+}
+
+/// Add \a n to \a counter, if profiling is active.
+void profile_count(const char* counter, long n) {
+    if(! active)
+        return;
+    MutexLock lock(profileMutex);
+    std::vector<Counter>::iterator it=counters.begin();
+    while(it!=counters.end() && it->name!=counter)
+        ++it;
+    if(it == counters.end()) {
+        Counter c = {counter, 0};
+        it = counters.insert(it, c);
+    }
+    it->value += n;
+}
+
+/// Value of \a counter, 0 if it was not counted.
+long profile_counter(const char* counter) {
+    MutexLock lock(profileMutex);
+    for(std::vector<Counter>::const_iterator it=counters.begin();
+        it!=counters.end(); ++it)
+        if(it->name == counter)
+            return it->value;
+    return 0;
+}
+
+/// Accumulated wall time of \a stage, 0 if it was not measured.
+double profile_wall(const char* stage) {
+    MutexLock lock(profileMutex);
+    for(std::vector<StageTime>::const_iterator it=stages.begin();
+        it!=stages.end(); ++it)
+        if(it->name == stage)
+            return it->wall;
+    return 0;
+}
+
+/// Record \a wall and \a cpu times and \a peak memory for \a stage.
+static void add(const char* stage, double wall, double cpu, long long peak) {
+    MutexLock lock(profileMutex);
+    std::vector<StageTime>::iterator it=stages.begin();
+    while(it!=stages.end() && it->name!=stage)
+        ++it;
+    if(it == stages.end()) {
+        StageTime s = {stage, 0, 0, 0, 0};
+        it = stages.insert(it, s);
+    }
+    ++it->calls;
+    it->wall += wall;
+    it->cpu += cpu;
+    if(it->peak < peak)
+        it->peak = peak;
+}
+
+/// Write string \a s in JSON format.
+static void write_string(std::ostream& out, const std::string& s) {
+    out << '"';
+    for(std::string::const_iterator it=s.begin(); it!=s.end(); ++it) {
+        if(*it=='"' || *it=='\\')
+            out << '\\';
+        if(static_cast<unsigned char>(*it) >= 0x20)
+            out << *it;
+    }
+    out << '"';
+}
+
+/// Write the records as a JSON object on a single line:
+/// {"stages":[{"name":...,"calls":...,"wall":...,"cpu":...,"peak_bytes":...},
+///  ...], "counters":{"name":value,...}}. Times are in seconds, peak_bytes
+/// is the high-water mark of image memory since profile_start at the end of
+/// the stage.
+void profile_write_json(std::ostream& out) {
+    MutexLock lock(profileMutex);
+    out << "{\"stages\":[";
+    for(size_t i=0; i<stages.size(); i++) {
+        out << (i? ",": "") << "{\"name\":";
+        write_string(out, stages[i].name);
+        out << ",\"calls\":" << stages[i].calls
+            << ",\"wall\":" << stages[i].wall
+            << ",\"cpu\":" << stages[i].cpu
+            << ",\"peak_bytes\":" << stages[i].peak << '}';
+    }
+    out << "],\"counters\":{";
+    for(size_t i=0; i<counters.size(); i++) {
+        out << (i? ",": "");
+        write_string(out, counters[i].name);
+        out << ':' << counters[i].value;
+    }
+    out << "}}" << std::endl;
+}
+
+/// Start measuring stage \a name, which must exist until the timer stops.
+ProfileTimer::ProfileTimer(const char* name)
+: stage(active? name: 0), wall(0), cpu(0), watch(-1) {
+    if(stage) {
+        wall = wall_time();
+        cpu = cpu_time();
+        watch = image_memory_watch();
+    }
+}
+
+/// Record the time since construction, only the first time it is called.
+void ProfileTimer::stop() {
+    if(! stage)
+        return;
+    add(stage, wall_time()-wall, cpu_time()-cpu, image_memory_unwatch(watch));
+    stage = 0;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file profile.h
+ * @brief Time spent in each stage of the program, reported in JSON
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <ostream>
+
+void profile_start();
+void profile_stop();
+bool profile_active();
+void profile_count(const char* counter, long n);
+long profile_counter(const char* counter);
+double profile_wall(const char* stage);
+long long profile_resident_memory();
+void profile_write_json(std::ostream& out);
+
+/// Measure wall and CPU time of a stage, from construction to destruction or
+/// call to stop(), if profiling is active.
+///
+/// CPU time is the one of the whole process, so it includes the threads of
+/// the stage, but also those of concurrent stages.
+class ProfileTimer {
+    const char* stage;
+    double wall, cpu;
+    int watch; ///< Watch of peak memory during the stage
+public:
+    explicit ProfileTimer(const char* name);
+    ~ProfileTimer() { stop(); }
+    void stop();
+};
+
+#endif
@@ -0,0 +1,46 @@
+/**
+ * @file progress.h
+ * @brief Report of progress of long computations, with cancellation
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+/// Observer of the progress of computations, which can cancel them.
+///
+/// Derived classes implement update, which receives the name of the stage
+/// ("cost_volume" or "patch_match", "left_right_check", "weighted_median")
+/// and the fraction of it that is done, and returns false to cancel. Calls
+/// are never concurrent, but may come from different threads. A cancelled
+/// computation stops at its next check and returns an empty result.
+class Progress {
+    volatile bool stop;
+protected:
+    virtual bool update(const char* stage, float fraction) = 0;
+public:
+    Progress(): stop(false) {}
+    virtual ~Progress() {}
+
+    /// Report \a fraction done of \a stage, return false if cancelled.
+    bool report(const char* stage, float fraction) {
+        if(! stop && ! update(stage, fraction))
+            stop = true;
+        return ! stop;
+    }
+    /// Has a call to update asked for cancellation?
+    bool cancelled() const { return stop; }
+};
+
+#endif
@@ -0,0 +1,350 @@
+/**
+ * @file server.cpp
+ * @brief Persistent server computing disparity maps on request
+ * @author Pascal Monasse <monasse@imagine.enpc.fr>
+ *
+ * Copyright (c) 2012-2013, Pascal Monasse
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * You should have received a copy of the GNU General Pulic License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "server.h"
+#include "costVolume.h"
+#include "guidance.h"
+#include "occlusion.h"
+#include "image.h"
+#include "mutex.h"
+#include "progress.h"
+#include <algorithm>
+#include <cfloat>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// Maximal number of pixels of an image in a request
+static const int MAX_PIXELS = 1<<26;
+
+/// Maximal radius of the guided filter and of the weighted median in a request
+static const int MAX_RADIUS = 255;
+
+/// Maximal number of client connections served at the same time
+static const int MAX_CONNECTIONS = 8;
+
+/// Number of floats of the first read of a request payload, see read_payload
+static const size_t PAYLOAD_CHUNK = 1<<20;
+
+/// Header of a request, followed by the 3*width*height float values of each
+/// color image (channels not interlaced, as in Image).
+///
+/// All fields are 32-bit values in native byte order.
+struct RequestHeader {
+    int width, height;
+    int dispMin, dispMax;
+    float color_threshold, gradient_threshold, alpha;
+    int kernel_radius;
+    float epsilon;
+    int tol_disp; ///< Negative for no left-right check
+    int sense; ///< Fill occlusions if 'r' or 'l', 0 for no densification
+    int median_radius;
+    float sigma_space, sigma_color;
+};
+
+/// Header of a reply, followed by the width*height float disparities.
+///
+/// If \c status is not 0, the request was rejected and nothing follows.
+struct ReplyHeader {
+    int status;
+    int width, height;
+};
+
+/// Read exactly \a n bytes, return false at end of stream or on error.
+static bool read_all(int fd, void* buffer, size_t n) {
+    char* p = static_cast<char*>(buffer);
+    while(n > 0) {
+        ssize_t k = read(fd, p, n);
+        if(k < 0 && errno == EINTR)
+            continue;
+        if(k <= 0)
+            return false;
+        p += k;
+        n -= static_cast<size_t>(k);
+    }
+    return true;
+}
+
+/// Write exactly \a n bytes, return false on error.
+static bool write_all(int fd, const void* buffer, size_t n) {
+    const char* p = static_cast<const char*>(buffer);
+    while(n > 0) {
+        ssize_t k = write(fd, p, n);
+        if(k < 0 && errno == EINTR)
+            continue;
+        if(k <= 0)
+            return false;
+        p += k;
+        n -= static_cast<size_t>(k);
+    }
+    return true;
+}
+
+/// Read the \a n floats of the images of a request in \a pix.
+///
+/// The header alone does not allocate the buffer for the announced size: it
+/// grows by doubling as the data arrives, from PAYLOAD_CHUNK floats. The
+/// last growth needs temporarily 1.5 times the final size.
+static bool read_payload(int fd, size_t n, TrackedVector<float>& pix) {
+    size_t size=0;
+    while(size < n) {
+        const size_t next = std::min(n, std::max(2*size, PAYLOAD_CHUNK));
+        pix.resize(next);
+        if(! read_all(fd, &pix[size], (next-size)*sizeof(float)))
+            return false;
+        size = next;
+    }
+    return true;
+}
+
+/// Whether \a v is in [\a vMin,\a vMax], false for NaN.
+static bool in_range(float v, float vMin, float vMax) {
+    return (vMin <= v && v <= vMax);
+}
+
+/// Check that the request can be processed, from its header only.
+///
+/// Real parameters must be finite: thresholds nonnegative, alpha in [0,1],
+/// epsilon positive, as well as the sigmas if densification is requested.
+static bool valid(const RequestHeader& req) {
+    const long long range = static_cast<long long>(req.dispMax)-req.dispMin;
+    const bool dense = (req.sense != 0);
+    return (req.width >= 2 && req.height >= 1 &&
+            req.width <= MAX_PIXELS/req.height &&
+            0 <= range && range < 65535 &&
+            in_range(req.color_threshold, 0, FLT_MAX) &&
+            in_range(req.gradient_threshold, 0, FLT_MAX) &&
+            in_range(req.alpha, 0, 1) &&
+            0 <= req.kernel_radius && req.kernel_radius <= MAX_RADIUS &&
+            in_range(req.epsilon, FLT_MIN, FLT_MAX) &&
+            (! dense || req.sense == 'r' || req.sense == 'l') &&
+            (! dense || (0 <= req.median_radius &&
+                         req.median_radius <= MAX_RADIUS &&
+                         in_range(req.sigma_space, FLT_MIN, FLT_MAX) &&
+                         in_range(req.sigma_color, FLT_MIN, FLT_MAX))));
+}
+
+/// Cancel the computation when the client cannot receive the reply anymore.
+///
+/// The reply stream is polled at each progress report: a socket whose peer
+/// closed is hung up, a pipe without reader is in error. A client that only
+/// closes its sending side still gets its reply.
+class ClientGone : public Progress {
+    int fd;
+protected:
+    bool update(const char*, float) {
+        pollfd p;
+        p.fd = fd;
+        p.events = 0; // Only hang-up and error, always reported
+        p.revents = 0;
+        return ! (poll(&p, 1, 0) > 0 && (p.revents & (POLLHUP|POLLERR)));
+    }
+public:
+    explicit ClientGone(int out): fd(out) {}
+};
+
+/// Same pipeline as the command line program, without intermediate outputs.
+/// Return an empty image if \a progress cancels the computation.
+static Image compute_disparity(const RequestHeader& req, Image im1, Image im2,
+                               Progress& progress) {
+    ParamGuidedFilter paramGF;
+    paramGF.color_threshold = req.color_threshold;
+    paramGF.gradient_threshold = req.gradient_threshold;
+    paramGF.alpha = req.alpha;
+    paramGF.kernel_radius = req.kernel_radius;
+    paramGF.epsilon = req.epsilon;
+    ParamOcclusion paramOcc;
+    paramOcc.tol_disp = (req.tol_disp>=0)? req.tol_disp: 0;
+    paramOcc.median_radius = req.median_radius;
+    paramOcc.sigma_space = req.sigma_space;
+    paramOcc.sigma_color = req.sigma_color;
+    const int dMin=req.dispMin, dMax=req.dispMax;
+
+    StereoPairContext pair(im1, im2, true); // Through cache, for next requests
+    Image disp = filter_cost_volume(pair, 0, dMin, dMax, paramGF, &progress);
+    if(! progress.cancelled() && (req.tol_disp >= 0 || req.sense)) {
+        Image disp2 = filter_cost_volume(pair, 1, -dMax, -dMin, paramGF,
+                                         &progress);
+        if(! progress.cancelled())
+            detect_occlusion(disp, disp2, static_cast<float>(dMin-1),
+                             paramOcc.tol_disp, &progress);
+    }
+    if(! progress.cancelled() && req.sense) {
+        Image dispDense = disp.clone();
+        if(req.sense == 'r')
+            dispDense.fillMaxX(static_cast<float>(dMin));
+        else
+            dispDense.fillMinX(static_cast<float>(dMin));
+        fill_occlusion(dispDense, pair.medianColor(0), disp, dMin, dMax,
+                       paramOcc, &progress);
+    }
+    return progress.cancelled()? Image(): disp;
+}
+
+/// Answer requests read from \a in, writing replies in \a out, until the end
+/// of stream or an error.
+static void serve_stream(int in, int out) {
+    RequestHeader req;
+    while(read_all(in, &req, sizeof(req))) {
+        ReplyHeader rep = {1, 0, 0};
+        if(! valid(req)) { // Payload size unknown, so stop there
+            write_all(out, &rep, sizeof(rep));
+            return;
+        }
+        const size_t n = static_cast<size_t>(req.width)*req.height;
+        TrackedVector<float> pix;
+        if(! read_payload(in, 2*3*n, pix))
+            return;
+        Image im1(&pix[0], req.width, req.height);
+        Image im2(&pix[3*n], req.width, req.height);
+        ClientGone progress(out);
+        Image disp = compute_disparity(req, im1, im2, progress);
+        if(disp.width() == 0) {
+            std::cerr << "Client gone, request cancelled" << std::endl;
+            return;
+        }
+        rep.status = 0;
+        rep.width = req.width;
+        rep.height = req.height;
+        if(! (write_all(out, &rep, sizeof(rep)) &&
+              write_all(out, &disp(0,0), n*sizeof(float))))
+            return;
+    }
+}
+
+/// Number of connections being served, protected by connectionsMutex
+static int connections = 0;
+static Mutex connectionsMutex;
+
+/// Thread answering the requests of a client connection.
+static void* serve_connection(void* arg) {
+    int* fd = static_cast<int*>(arg);
+    serve_stream(*fd, *fd);
+    close(*fd);
+    delete fd;
+    MutexLock lock(connectionsMutex);
+    --connections;
+    return 0;
+}
+
+/// Reserve a slot for a new connection, false if MAX_CONNECTIONS are served.
+static bool open_connection() {
+    MutexLock lock(connectionsMutex);
+    if(connections >= MAX_CONNECTIONS)
+        return false;
+    ++connections;
+    return true;
+}
+
+/// Release the slot of a connection whose thread could not start.
+static void cancel_connection() {
+    MutexLock lock(connectionsMutex);
+    --connections;
+}
+
+/// Serve requests from standard input, replies on standard output.
+///
+/// Messages written on standard output are redirected to standard error so
+/// that they do not corrupt the replies.
+static int run_stdin_server() {
+    std::streambuf* buf = std::cout.rdbuf(std::cerr.rdbuf());
+    serve_stream(0, 1);
+    std::cout.rdbuf(buf);
+    return 0;
+}
+
+/// Listen on UNIX domain socket \a socketPath, or on standard input if it is
+/// "-". Each client connection is served in its own thread, so that requests
+/// of different clients are processed concurrently. The socket connection
+/// may be kept open to send several requests in a row. Beyond
+/// MAX_CONNECTIONS clients, a new connection gets a rejection reply and is
+/// closed.
+int run_server(const char* socketPath) {
+    signal(SIGPIPE, SIG_IGN); // Client leaving must not kill the server
+    if(std::string("-") == socketPath)
+        return run_stdin_server();
+
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(std::strlen(socketPath) >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return 1;
+    }
+    std::strcpy(addr.sun_path, socketPath);
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s < 0) {
+        std::cerr << "Cannot create socket" << std::endl;
+        return 1;
+    }
+    unlink(socketPath);
+    if(bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+       listen(s, SOMAXCONN) != 0) {
+        std::cerr << "Cannot listen on socket " << socketPath << std::endl;
+        close(s);
+        return 1;
+    }
+    std::cout << "Listening on " << socketPath << std::endl;
+
+    while(true) {
+        int c = accept(s, 0, 0);
+        if(c < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        if(! open_connection()) {
+            ReplyHeader rep = {1, 0, 0};
+            write_all(c, &rep, sizeof(rep));
+            close(c);
+            continue;
+        }
+        pthread_t thread;
+        int* fd = new int(c);
+        if(pthread_create(&thread, 0, serve_connection, fd) != 0) {
+            cancel_connection();
+            close(c);
+            delete fd;
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    std::cerr << "Error accepting connection on " << socketPath << std::endl;
+    close(s);
+    unlink(socketPath);
+    return 1;
+}
+
+#else
+
+int run_server(const char*) {
+    std::cerr << "Server mode is not available on this platform" << std::endl;
+    return 1;
+}
+
+#endif